@@ -0,0 +1,833 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+/*
+ *  End to end benchmark.  Runs the gateway against an emulated stick
+ *  and a minimal MQTT broker stand-in, drives scripted workloads
+ *  through it and writes the results as JSON.
+ *
+ *  The broker stand-in runs in its own thread and plays the part of
+ *  the MQTT clients; the gateway runs in the main thread, exactly as
+ *  in xcomfortd.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <mosquitto.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gateway.h"
+#include "emulator.h"
+
+static int64_t
+now_us()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (int64_t(tp.tv_sec) * 1000000) + (tp.tv_nsec / 1000);
+}
+
+static int64_t
+thread_cpu_us()
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_THREAD, &usage);
+    return (int64_t(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+	    usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+/* Timestamps shared between the gateway thread (which sees the USB
+   side) and the broker thread (which sees the MQTT side). */
+
+class Timeline
+{
+public:
+
+    Timeline()
+    {
+	for (int i = 0; i < 256; ++i)
+	    set_time[i] = ack_time[i] = 0;
+	for (int i = 0; i < 16; ++i)
+	    seq_datapoint[i] = -1;
+    }
+
+    // The broker sent a set message for the datapoint
+
+    void Set(int datapoint)
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Keep the oldest set that hasn't reached the stick yet
+
+	if (!set_time[datapoint])
+	    set_time[datapoint] = now_us();
+    }
+
+    // A frame for the datapoint was handed to the stick
+
+    void Frame(int datapoint, int seq_no)
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (set_time[datapoint])
+	{
+	    set_to_frame.push_back(now_us() - set_time[datapoint]);
+	    set_time[datapoint] = 0;
+	}
+
+	seq_datapoint[seq_no & 0xf] = datapoint;
+    }
+
+    // The stick acked a frame
+
+    void Ack(int seq_no)
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	int datapoint = seq_datapoint[seq_no & 0xf];
+
+	if (datapoint != -1)
+	    ack_time[datapoint] = now_us();
+    }
+
+    // The broker received a status publish for the datapoint
+
+    void Published(int datapoint)
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (ack_time[datapoint])
+	{
+	    ack_to_publish.push_back(now_us() - ack_time[datapoint]);
+	    ack_time[datapoint] = 0;
+	}
+    }
+
+    std::mutex mutex;
+
+    std::vector<int64_t> set_to_frame;
+    std::vector<int64_t> ack_to_publish;
+
+private:
+
+    int64_t set_time[256];
+    int64_t ack_time[256];
+    int seq_datapoint[16];
+};
+
+/* Emulated stick that reports to the timeline when frames pass
+   through it. */
+
+class InstrumentedStick
+    : public EmulatedStick,
+      public TransportListener
+{
+public:
+
+    InstrumentedStick(const emulator_config& config, Timeline& timeline)
+	: EmulatedStick(config),
+	  timeline(timeline),
+	  listener(NULL)
+    {
+    }
+
+    virtual bool Init(int epoll_fd, TransportListener* listener)
+    {
+	this->listener = listener;
+
+	return EmulatedStick::Init(epoll_fd, this);
+    }
+
+    virtual int Send(const unsigned char* buffer, size_t length)
+    {
+	if (buffer[XC_MSG_TYPE] == MGW_PT_TX)
+	    timeline.Frame(buffer[XC_TX_DATAPOINT], buffer[XC_TX_SEQ_AND_PRI] >> 4);
+
+	return EmulatedStick::Send(buffer, length);
+    }
+
+    virtual void FrameReceived(const unsigned char* buffer, size_t length)
+    {
+	if (buffer[XC_MSG_TYPE] == MGW_PT_STATUS && buffer[XC_STATUS_TYPE] == MGW_STT_OK)
+	    timeline.Ack(buffer[4] >> 4);
+
+	listener->FrameReceived(buffer, length);
+    }
+
+    virtual void FrameSent() { listener->FrameSent(); }
+    virtual void TransportFailed() { listener->TransportFailed(); }
+    virtual void TransportFinished() { listener->TransportFinished(); }
+    virtual void TransportLost() { listener->TransportLost(); }
+    virtual void TransportRestored() { listener->TransportRestored(); }
+
+    virtual void Error(const char* fmt, ...) {}
+    virtual void Info(const char* fmt, ...) {}
+
+private:
+
+    Timeline& timeline;
+    TransportListener* listener;
+};
+
+class QuietGateway
+    : public XCtoMQTT
+{
+public:
+
+    QuietGateway(int coalesce_window)
+	: XCtoMQTT(false, false, coalesce_window, 0)
+    {
+    }
+
+protected:
+
+    virtual void Error(const char* fmt, ...) {}
+    virtual void Info(const char* fmt, ...) {}
+};
+
+/* Just enough of an MQTT 3.1.1 broker to serve one client: the
+   gateway.  Everything the gateway publishes is recorded; set
+   messages are injected by the workload scripts. */
+
+class Broker
+{
+public:
+
+    Broker(Timeline& timeline)
+	: timeline(timeline),
+	  listen_fd(-1),
+	  client_fd(-1),
+	  subscribed(false),
+	  publishes(0),
+	  port(0)
+    {
+	for (int i = 0; i < 256; ++i)
+	    published[i] = 0;
+    }
+
+    ~Broker()
+    {
+	Drop();
+
+	if (listen_fd != -1)
+	    close(listen_fd);
+    }
+
+    bool Listen()
+    {
+	sockaddr_in address;
+	socklen_t length = sizeof(address);
+
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0)
+	    return false;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(listen_fd, (sockaddr*) &address, sizeof(address)) < 0 ||
+	    listen(listen_fd, 4) < 0 ||
+	    getsockname(listen_fd, (sockaddr*) &address, &length) < 0)
+	    return false;
+
+	port = ntohs(address.sin_port);
+
+	return true;
+    }
+
+    int Port() const { return port; }
+
+    // Wait for the gateway to connect and subscribe
+
+    bool Accept(int timeout)
+    {
+	pollfd fds = { listen_fd, POLLIN, 0 };
+	int one = 1;
+
+	if (poll(&fds, 1, timeout) <= 0)
+	    return false;
+
+	client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (client_fd < 0)
+	    return false;
+
+	setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	subscribed = false;
+
+	int64_t deadline = now_us() + int64_t(timeout) * 1000;
+
+	while (!subscribed && now_us() < deadline)
+	    if (!Pump(10))
+		return false;
+
+	return subscribed;
+    }
+
+    // Close the connection, as if the broker went away
+
+    void Drop()
+    {
+	if (client_fd != -1)
+	{
+	    close(client_fd);
+	    client_fd = -1;
+	}
+    }
+
+    void Set(int datapoint, const char* type, const char* value)
+    {
+	char topic[64];
+
+	snprintf(topic, sizeof(topic), "xcomfort/%d/set/%s", datapoint, type);
+
+	timeline.Set(datapoint);
+	Publish(topic, value);
+    }
+
+    // Handle incoming packets for up to timeout ms
+
+    bool Pump(int timeout)
+    {
+	pollfd fds = { client_fd, POLLIN, 0 };
+	int64_t deadline = now_us() + int64_t(timeout) * 1000;
+
+	do
+	{
+	    int left = int((deadline - now_us()) / 1000);
+
+	    if (poll(&fds, 1, left > 0 ? left : 0) < 0)
+		return false;
+
+	    if (fds.revents & (POLLERR | POLLHUP))
+		return false;
+
+	    if (fds.revents & POLLIN)
+	    {
+		char buffer[4096];
+		ssize_t got = read(client_fd, buffer, sizeof(buffer));
+
+		if (got <= 0)
+		    return false;
+
+		input.append(buffer, got);
+
+		while (Packet())
+		    ;
+	    }
+	}
+	while (now_us() < deadline);
+
+	return true;
+    }
+
+    // Status publishes received, per datapoint and in total
+
+    int Published(int datapoint) const { return published[datapoint]; }
+    int Publishes() const { return publishes; }
+
+private:
+
+    void Write(const std::string& packet)
+    {
+	const char* data = packet.data();
+	size_t left = packet.size();
+
+	while (left)
+	{
+	    ssize_t written = write(client_fd, data, left);
+
+	    if (written <= 0)
+		return;
+
+	    data += written;
+	    left -= written;
+	}
+    }
+
+    static void Length(std::string& packet, size_t length)
+    {
+	do
+	{
+	    unsigned char digit = length % 128;
+
+	    length /= 128;
+	    if (length)
+		digit |= 0x80;
+
+	    packet += (char) digit;
+	}
+	while (length);
+    }
+
+    void Publish(const char* topic, const char* payload)
+    {
+	std::string packet(1, (char) 0x30);
+	size_t topic_length = strlen(topic);
+
+	Length(packet, 2 + topic_length + strlen(payload));
+	packet += (char) (topic_length >> 8);
+	packet += (char) (topic_length & 0xff);
+	packet += topic;
+	packet += payload;
+
+	Write(packet);
+    }
+
+    // Parse one packet from the input buffer, if complete
+
+    bool Packet()
+    {
+	size_t length = 0;
+	size_t header = 1;
+	int shift = 0;
+
+	for (;;)
+	{
+	    if (input.size() <= header)
+		return false;
+
+	    unsigned char digit = input[header++];
+
+	    length |= size_t(digit & 0x7f) << shift;
+	    shift += 7;
+
+	    if (!(digit & 0x80))
+		break;
+	}
+
+	if (input.size() < header + length)
+	    return false;
+
+	unsigned char type = input[0];
+	std::string body = input.substr(header, length);
+
+	input.erase(0, header + length);
+
+	switch (type >> 4)
+	{
+	case 1: // CONNECT
+	    Write(std::string("\x20\x02\x00\x00", 4));
+	    break;
+
+	case 3: // PUBLISH
+	    {
+		size_t topic_length = ((unsigned char) body[0] << 8) | (unsigned char) body[1];
+		std::string topic = body.substr(2, topic_length);
+		int qos = (type >> 1) & 3;
+		int datapoint;
+		char kind[16];
+
+		if (qos)
+		{
+		    std::string puback("\x40\x02", 2);
+
+		    puback += body.substr(2 + topic_length, 2);
+		    Write(puback);
+		}
+
+		if (sscanf(topic.c_str(), "xcomfort/%d/get/%15s", &datapoint, kind) == 2 &&
+		    datapoint >= 0 && datapoint < 256 &&
+		    strcmp(kind, "dimmer") == 0)
+		{
+		    timeline.Published(datapoint);
+		    published[datapoint]++;
+		    publishes++;
+		}
+	    }
+	    break;
+
+	case 8: // SUBSCRIBE
+	    {
+		std::string suback("\x90\x03", 2);
+
+		suback += body.substr(0, 2);
+		suback += (char) 0;
+		Write(suback);
+
+		subscribed = true;
+	    }
+	    break;
+
+	case 10: // UNSUBSCRIBE
+	    {
+		std::string unsuback("\xb0\x02", 2);
+
+		unsuback += body.substr(0, 2);
+		Write(unsuback);
+	    }
+	    break;
+
+	case 12: // PINGREQ
+	    Write(std::string("\xd0\x00", 2));
+	    break;
+
+	default:
+	    break;
+	}
+
+	return true;
+    }
+
+    Timeline& timeline;
+
+    int listen_fd;
+    int client_fd;
+
+    bool subscribed;
+
+    std::string input;
+
+    int published[256];
+    int publishes;
+
+    int port;
+};
+
+struct workload
+{
+    const char* name;
+
+    // Emulated stick
+
+    int devices;
+    double status_rate;
+
+    int coalesce_window;
+
+    // Runs in the broker thread; returns the number of commands sent
+
+    int (*script)(Broker& broker, std::string& notes);
+};
+
+static bool
+wait_for(Broker& broker, int datapoint, int count, int timeout)
+{
+    int64_t deadline = now_us() + int64_t(timeout) * 1000;
+
+    while (broker.Published(datapoint) < count)
+	if (now_us() > deadline || !broker.Pump(5))
+	    return false;
+
+    return true;
+}
+
+// One switch command at a time, waiting for each to complete
+
+static int
+single_switch(Broker& broker, std::string& notes)
+{
+    const int commands = 200;
+
+    for (int i = 0; i < commands; ++i)
+    {
+	int datapoint = 1 + i % 8;
+
+	broker.Set(datapoint, "switch", i & 8 ? "false" : "true");
+
+	if (!wait_for(broker, datapoint, broker.Published(datapoint) + 1, 5000))
+	{
+	    notes = "timed out waiting for status";
+	    return i;
+	}
+    }
+
+    return commands;
+}
+
+// A scene setting 100 dimmers at once
+
+static int
+scene(Broker& broker, std::string& notes)
+{
+    const int datapoints = 100;
+
+    for (int datapoint = 1; datapoint <= datapoints; ++datapoint)
+	broker.Set(datapoint, "dimmer", "50");
+
+    int64_t deadline = now_us() + 60000000;
+
+    for (int datapoint = 1; datapoint <= datapoints; ++datapoint)
+	while (broker.Published(datapoint) < 1)
+	    if (now_us() > deadline || !broker.Pump(5))
+	    {
+		notes = "timed out waiting for status";
+		return datapoints;
+	    }
+
+    return datapoints;
+}
+
+// A dimmer slider sending 25 values per second for four seconds
+
+static int
+slider_storm(Broker& broker, std::string& notes)
+{
+    const int commands = 100;
+
+    for (int i = 0; i < commands; ++i)
+    {
+	char value[8];
+
+	snprintf(value, sizeof(value), "%d", i);
+	broker.Set(1, "dimmer", value);
+
+	if (!broker.Pump(40))
+	    return i;
+    }
+
+    // Let the last value settle
+
+    broker.Pump(1000);
+
+    return commands;
+}
+
+// No commands, lots of status messages from the devices
+
+static int
+sensor_flood(Broker& broker, std::string& notes)
+{
+    broker.Pump(5000);
+
+    char note[64];
+
+    snprintf(note, sizeof(note), "%d status publishes", broker.Publishes());
+    notes = note;
+
+    return 0;
+}
+
+// The broker goes away repeatedly while commands are being sent
+
+static int
+reconnect_storm(Broker& broker, std::string& notes)
+{
+    const int rounds = 3;
+    int commands = 0;
+
+    for (int round = 0; round < rounds; ++round)
+    {
+	for (int datapoint = 1; datapoint <= 10; ++datapoint, ++commands)
+	    broker.Set(datapoint, "dimmer", round & 1 ? "20" : "80");
+
+	broker.Pump(200);
+	broker.Drop();
+
+	int64_t dropped = now_us();
+
+	if (!broker.Accept(60000))
+	{
+	    notes = "gateway did not reconnect";
+	    return commands;
+	}
+
+	char note[64];
+
+	snprintf(note, sizeof(note), "%sreconnect %d ms", notes.empty() ? "" : ", ",
+		 int((now_us() - dropped) / 1000));
+	notes += note;
+    }
+
+    broker.Pump(1000);
+
+    return commands;
+}
+
+static const workload workloads[] =
+{
+    { "single_switch",   8,   0,   0, single_switch },
+    { "scene_100",       100, 0,   0, scene },
+    { "slider_storm",    1,   0,   0, slider_storm },
+    { "slider_storm_coalesced", 1, 0, 250, slider_storm },
+    { "sensor_flood",    16,  200, 0, sensor_flood },
+    { "reconnect_storm", 10,  0,   0, reconnect_storm },
+};
+
+static int64_t
+percentile(std::vector<int64_t>& values, double percentile)
+{
+    if (values.empty())
+	return 0;
+
+    std::sort(values.begin(), values.end());
+
+    size_t index = size_t(percentile / 100 * (values.size() - 1) + 0.5);
+
+    return values[index];
+}
+
+static bool
+run(const workload& load, int latency, std::string& json)
+{
+    Timeline timeline;
+    Broker broker(timeline);
+    emulator_config config;
+    std::atomic<bool> done(false);
+    std::string notes;
+    int commands = 0;
+    int epoll_fd;
+
+    config.devices = load.devices;
+    config.latency = latency;
+    config.jitter = latency / 2;
+    config.status_rate = load.status_rate;
+
+    if (!broker.Listen())
+	return false;
+
+    InstrumentedStick stick(config, timeline);
+    QuietGateway gateway(load.coalesce_window);
+
+    gateway.SetTransport(&stick);
+
+    std::thread client([&] {
+	    if (broker.Accept(10000))
+		commands = load.script(broker, notes);
+	    else
+		notes = "gateway did not connect";
+
+	    done = true;
+	});
+
+    epoll_fd = epoll_create(10);
+
+    if (!gateway.Init(epoll_fd, "127.0.0.1", broker.Port(), NULL, NULL))
+    {
+	done = true;
+	client.join();
+	gateway.Stop();
+	close(epoll_fd);
+	return false;
+    }
+
+    int64_t start = now_us();
+    int64_t cpu_start = thread_cpu_us();
+
+    while (!done)
+    {
+	epoll_event event;
+	int timeout = gateway.Prepoll(epoll_fd);
+
+	if (timeout < 0 || timeout > 100)
+	    timeout = 100;
+
+	if (epoll_wait(epoll_fd, &event, 1, timeout) > 0)
+	    gateway.Poll(event);
+    }
+
+    int64_t cpu = thread_cpu_us() - cpu_start;
+    int64_t elapsed = now_us() - start;
+
+    client.join();
+
+    uint64_t frames = stick.FramesSent() + stick.FramesReceived();
+
+    std::lock_guard<std::mutex> lock(timeline.mutex);
+    char buffer[1024];
+
+    snprintf(buffer, sizeof(buffer),
+	     "    {\"name\": \"%s\", \"commands\": %d, \"duration_ms\": %lld, "
+	     "\"commands_per_s\": %.1f, \"frames_sent\": %llu, \"frames_received\": %llu, "
+	     "\"set_to_frame_us\": {\"p50\": %lld, \"p99\": %lld, \"samples\": %zu}, "
+	     "\"ack_to_publish_us\": {\"p50\": %lld, \"p99\": %lld, \"samples\": %zu}, "
+	     "\"cpu_us_per_1000_frames\": %lld, \"notes\": \"%s\"}",
+	     load.name,
+	     commands,
+	     (long long) (elapsed / 1000),
+	     elapsed ? commands * 1e6 / elapsed : 0.0,
+	     (unsigned long long) stick.FramesSent(),
+	     (unsigned long long) stick.FramesReceived(),
+	     (long long) percentile(timeline.set_to_frame, 50),
+	     (long long) percentile(timeline.set_to_frame, 99),
+	     timeline.set_to_frame.size(),
+	     (long long) percentile(timeline.ack_to_publish, 50),
+	     (long long) percentile(timeline.ack_to_publish, 99),
+	     timeline.ack_to_publish.size(),
+	     (long long) (frames ? cpu * 1000 / frames : 0),
+	     notes.c_str());
+
+    json += buffer;
+
+    printf("%-24s %5d commands %8.1f/s  set->frame p50 %6lld us  ack->publish p50 %6lld us  %s\n",
+	   load.name, commands, elapsed ? commands * 1e6 / elapsed : 0.0,
+	   (long long) percentile(timeline.set_to_frame, 50),
+	   (long long) percentile(timeline.ack_to_publish, 50),
+	   notes.c_str());
+
+    gateway.Stop();
+    close(epoll_fd);
+
+    return true;
+}
+
+int
+main(int argc, char* argv[])
+{
+    const char* output = argc > 1 ? argv[1] : "bench.json";
+    const char* only = argc > 2 ? argv[2] : NULL;
+    int latency = 20;
+    std::string json = "{\n  \"workloads\": [\n";
+    bool first = true;
+
+    if (getenv("BENCH_LATENCY"))
+	latency = atoi(getenv("BENCH_LATENCY"));
+
+    for (unsigned i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i)
+    {
+	if (only && strcmp(only, workloads[i].name) != 0)
+	    continue;
+
+	if (!first)
+	    json += ",\n";
+
+	if (!run(workloads[i], latency, json))
+	{
+	    fprintf(stderr, "%s: failed to start\n", workloads[i].name);
+	    return 1;
+	}
+
+	first = false;
+    }
+
+    json += "\n  ]\n}\n";
+
+    FILE* file = fopen(output, "w");
+
+    if (!file)
+    {
+	fprintf(stderr, "can't write %s: %s\n", output, strerror(errno));
+	return 1;
+    }
+
+    fputs(json.c_str(), file);
+    fclose(file);
+
+    return 0;
+}
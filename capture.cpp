@@ -0,0 +1,204 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+static const char capture_magic[] = "XCCAP";
+
+CaptureWriter::CaptureWriter()
+    : file(NULL)
+{
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    Close();
+}
+
+bool
+CaptureWriter::Open(const char* path)
+{
+    unsigned char header[CAPTURE_HEADER_LENGTH];
+
+    Close();
+
+    file = fopen(path, "a+e");
+    if (!file)
+	return false;
+
+    // Records are small; let stdio batch them into large writes
+
+    setvbuf(file, NULL, _IOFBF, 64 * 1024);
+
+    // Appending to an existing capture continues it, if it's one we
+    // can add to
+
+    bool empty = fread(header, sizeof(header), 1, file) != 1;
+
+    if (!empty && (memcmp(header, capture_magic, 5) != 0 || header[5] != CAPTURE_VERSION))
+    {
+	Close();
+	return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+
+    if (empty)
+    {
+	if (ftell(file) != 0)
+	{
+	    Close();
+	    return false;
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, capture_magic, 5);
+	header[5] = CAPTURE_VERSION;
+
+	fwrite(header, sizeof(header), 1, file);
+    }
+
+    Write(CAPTURE_SESSION, NULL, 0);
+    Flush();
+
+    return !ferror(file);
+}
+
+void
+CaptureWriter::Close()
+{
+    if (file)
+    {
+	fclose(file);
+	file = NULL;
+    }
+}
+
+void
+CaptureWriter::Write(capture_direction direction, const unsigned char* frame, size_t length)
+{
+    unsigned char record[CAPTURE_RECORD_LENGTH];
+    struct timespec tp;
+
+    if (!file)
+	return;
+
+    if (length > INTR_RECV_LENGTH)
+	length = INTR_RECV_LENGTH;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    uint64_t time = (uint64_t(tp.tv_sec) * 1000000) + (tp.tv_nsec / 1000);
+
+    for (int i = 0; i < 8; ++i)
+	record[i] = time >> (i * 8);
+
+    record[8] = direction;
+    record[9] = length;
+
+    memset(record + 10, 0, INTR_RECV_LENGTH);
+    if (length)
+	memcpy(record + 10, frame, length);
+
+    fwrite(record, sizeof(record), 1, file);
+}
+
+void
+CaptureWriter::Flush()
+{
+    if (file)
+	fflush(file);
+}
+
+CaptureReader::CaptureReader()
+    : file(NULL),
+      offset(0),
+      last(-1)
+{
+}
+
+CaptureReader::~CaptureReader()
+{
+    Close();
+}
+
+bool
+CaptureReader::Open(const char* path)
+{
+    unsigned char header[CAPTURE_HEADER_LENGTH];
+
+    Close();
+
+    file = fopen(path, "re");
+    if (!file)
+	return false;
+
+    // Version 1 is the same, without sessions
+
+    if (fread(header, sizeof(header), 1, file) != 1 ||
+	memcmp(header, capture_magic, 5) != 0 ||
+	header[5] < 1 || header[5] > CAPTURE_VERSION)
+    {
+	Close();
+	return false;
+    }
+
+    offset = 0;
+    last = -1;
+
+    return true;
+}
+
+void
+CaptureReader::Close()
+{
+    if (file)
+    {
+	fclose(file);
+	file = NULL;
+    }
+}
+
+bool
+CaptureReader::Next(capture_record& record)
+{
+    unsigned char buffer[CAPTURE_RECORD_LENGTH];
+    uint64_t time;
+
+    for (;;)
+    {
+	if (!file || fread(buffer, sizeof(buffer), 1, file) != 1)
+	    return false;
+
+	time = 0;
+
+	for (int i = 0; i < 8; ++i)
+	    time |= uint64_t(buffer[i]) << (i * 8);
+
+	if (buffer[8] != CAPTURE_SESSION)
+	    break;
+
+	// The new session carries on where the last one ended
+
+	if (last != -1)
+	    offset = last - int64_t(time);
+    }
+
+    record.time = int64_t(time) + offset;
+    record.direction = buffer[8] ? CAPTURE_OUT : CAPTURE_IN;
+
+    last = record.time;
+    record.length = buffer[9] > INTR_RECV_LENGTH ? INTR_RECV_LENGTH : buffer[9];
+
+    memcpy(record.frame, buffer + 10, INTR_RECV_LENGTH);
+
+    return true;
+}
@@ -0,0 +1,104 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "transport.h"
+
+/* Capture files hold the raw frames exchanged with the stick.  After
+   an 8 byte header ("XCCAP" and a version byte, padded with zeroes)
+   follow fixed size records:
+
+     8 bytes   monotonic time in microseconds, little endian
+     1 byte    direction, CAPTURE_IN or CAPTURE_OUT
+     1 byte    length of the frame
+     32 bytes  the frame, padded with zeroes
+
+   Each run of the gateway appending to the file starts with a
+   CAPTURE_SESSION record without a frame.  Monotonic time starts over
+   at boot, and stands still while the gateway isn't running, so the
+   reader joins the sessions end to end. */
+
+#define CAPTURE_VERSION		2
+#define CAPTURE_HEADER_LENGTH	8
+#define CAPTURE_RECORD_LENGTH	(10 + INTR_RECV_LENGTH)
+
+enum capture_direction
+{
+    CAPTURE_IN      = 0, // From the stick
+    CAPTURE_OUT     = 1, // To the stick
+    CAPTURE_SESSION = 2  // The gateway was started
+};
+
+struct capture_record
+{
+    int64_t time;
+    capture_direction direction;
+    size_t length;
+    unsigned char frame[INTR_RECV_LENGTH];
+};
+
+// Appends frames to a capture file
+
+class CaptureWriter
+{
+public:
+
+    CaptureWriter();
+    ~CaptureWriter();
+
+    bool Open(const char* path);
+    void Close();
+
+    bool IsOpen() const { return file != NULL; }
+
+    // Does nothing unless a file is open
+
+    void Write(capture_direction direction, const unsigned char* frame, size_t length);
+
+    /* Records are buffered; write them out, so that they survive a
+       crash.  Called once per turn of the event loop. */
+
+    void Flush();
+
+private:
+
+    FILE* file;
+};
+
+// Reads the frames in a capture file back
+
+class CaptureReader
+{
+public:
+
+    CaptureReader();
+    ~CaptureReader();
+
+    bool Open(const char* path);
+    void Close();
+
+    // Returns false at the end of the file; sessions are skipped
+
+    bool Next(capture_record& record);
+
+private:
+
+    FILE* file;
+
+    // Added to times in the current session, and the last time read
+
+    int64_t offset;
+    int64_t last;
+};
+
+#endif
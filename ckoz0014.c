@@ -9,11 +9,12 @@
  *  found in the LICENSE file.
  */
 
+#include <stddef.h>
 #include <stdio.h>
-#include <arpa/inet.h>
 #include <syslog.h>
 
 #include "ckoz0014.h"
+#include "wire.h"
 
 const char* xc_rxevent_name(enum mci_rx_event event)
 {
@@ -53,6 +54,18 @@ const char* xc_rxevent_name(enum mci_rx_event event)
     }
 }
 
+const char* xc_txevent_name(enum mci_tx_event event)
+{
+    switch (event)
+    {
+    case MGW_TE_SWITCH:       return "MGW_TE_SWITCH";
+    case MGW_TE_REQUEST:      return "MGW_TE_REQUEST";
+    case MGW_TE_DIM:          return "MGW_TE_DIM";
+    case MGW_TE_JALO:         return "MGW_TE_JALO";
+    default:                  return "-- unknown --";
+    }
+}
+
 const char* xc_rssi_status_name(int rssi)
 {
     if (rssi <= 67)
@@ -93,66 +106,91 @@ const char* xc_shutter_status_name(int state)
     }
 }
 
-void xc_parse_packet(const unsigned char* buffer, size_t size, xc_parse_data* data)
+// The struct documents the layout that the offsets describe
+
+static_assert(offsetof(xc_ci_message, packet_tx.datapoint) == XC_TX_DATAPOINT, "TX layout");
+static_assert(offsetof(xc_ci_message, packet_tx.value) == XC_TX_VALUE, "TX layout");
+static_assert(offsetof(xc_ci_message, packet_tx.seq_and_pri) == XC_TX_SEQ_AND_PRI, "TX layout");
+static_assert(offsetof(xc_ci_message, pt_config.mode) == XC_CONFIG_MODE, "CONFIG layout");
+static_assert(offsetof(xc_ci_message, packet_rx.value) == XC_RX_VALUE, "RX layout");
+static_assert(offsetof(xc_ci_message, packet_rx.seqno) == XC_RX_SEQ_NO, "RX layout");
+static_assert(offsetof(xc_ci_message, pt_status.data) == XC_STATUS_DATA, "STATUS layout");
+
+/* Number of bytes the parser reads from a message of the given type.
+   Messages that are shorter are ignored, so the parser never reads
+   past the end of the buffer it's given, whatever its size. */
+
+static size_t xc_min_length(const unsigned char* buffer)
 {
-    struct xc_ci_message* msg = (struct xc_ci_message*) buffer;
+    switch (buffer[XC_MSG_TYPE])
+    {
+    case MGW_PT_RX:     return XC_RX_SEQ_NO + 1;
+    case MGW_PT_STATUS: return XC_STATUS_DATA + 4;
+    case MGW_PT_FW:     return 13;
+    default:            return 2;
+    }
+}
 
+void xc_parse_packet(const unsigned char* buffer, size_t size, xc_parse_data* data)
+{
     if (size < 2 ||
-        size < msg->message_size)
+        size < buffer[XC_MSG_SIZE] ||
+        size < xc_min_length(buffer))
 	return;
 
-    switch (msg->type)
+    switch (buffer[XC_MSG_TYPE])
     {
     case MGW_PT_RX:
 	data->recv(data->user_data,
-		   (enum mci_rx_event) msg->packet_rx.rx_event,
-		   msg->packet_rx.datapoint,
-		   (enum mci_rx_datatype) msg->packet_rx.rx_data_type,
-		   msg->packet_rx.value,
-		   msg->packet_rx.rssi,
-		   (enum mgw_rx_battery) msg->packet_rx.battery,
-		   msg->packet_rx.seqno);
+		   (enum mci_rx_event) buffer[XC_RX_EVENT],
+		   buffer[XC_RX_DATAPOINT],
+		   (enum mci_rx_datatype) buffer[XC_RX_DATA_TYPE],
+		   (int32_t) xc_load_le32(buffer + XC_RX_VALUE),
+		   buffer[XC_RX_RSSI],
+		   (enum mgw_rx_battery) buffer[XC_RX_BATTERY],
+		   buffer[XC_RX_SEQ_NO]);
 
 	break;
     
     case MGW_PT_STATUS:
     {
         int i;
+	int status = buffer[XC_STATUS_STATUS];
 	int seq_and_pri = -1;
 	int extra = -1;
+	int error = -1;
 
         // The ACK parsing isn't completely understood
 
-        switch (msg->pt_status.type)
+        switch (buffer[XC_STATUS_TYPE])
         {
         case MGW_STT_SERIAL:
-            printf("serial number: %08x\n", ntohl(msg->pt_status.data));
+	    data->info(data->user_data, MGW_CT_SERIAL, xc_load_be32(buffer + XC_STATUS_DATA));
             return;
 
         case MGW_STT_RELEASE:
-	    data->relno(data->user_data, msg->pt_status.status, buffer[4], buffer[5], buffer[6], buffer[7]);
+	    data->relno(data->user_data, status, buffer[4], buffer[5], buffer[6], buffer[7]);
             return;
 
         case MGW_CT_COUNTER_RX:
-            printf("counter rx: %08x\n", msg->pt_status.data);
-            return;
-
         case MGW_CT_COUNTER_TX:
-            printf("counter tx: %08x\n", msg->pt_status.data);
+	    data->info(data->user_data, buffer[XC_STATUS_TYPE], xc_load_le32(buffer + XC_STATUS_DATA));
             return;
 
         case MGW_STT_TIMEACCOUNT:
-            printf("time account: %d%%\n", buffer[4]);
+	    // Percent
+
+	    data->info(data->user_data, MGW_CT_TIMEACCOUNT, buffer[XC_STATUS_DATA]);
             return;
 
         case MGW_STT_SEND_RFSEQNO:
-            printf("RF sequence no flag: %d\n", msg->pt_status.status);
+            printf("RF sequence no flag: %d\n", status);
             return;
 
         default:
-	    printf("received MGW_PT_STATUS(%d) [", msg->message_size);
+	    printf("received MGW_PT_STATUS(%d) [", buffer[XC_MSG_SIZE]);
 
-	    for (i = 2; i < msg->message_size; ++i)
+	    for (i = 2; i < buffer[XC_MSG_SIZE]; ++i)
 	        printf("%02hhx ", buffer[i]);
 
 	    printf("]\n");
@@ -168,8 +206,9 @@ void xc_parse_packet(const unsigned char* buffer, size_t size, xc_parse_data* da
 
 	    seq_and_pri = buffer[5];
 	    extra = buffer[4];
+	    error = status;
 
-            switch (msg->pt_status.status)
+            switch (status)
             {
             case MGW_STS_GENERAL:
                 printf("general error\n");
@@ -204,7 +243,7 @@ void xc_parse_packet(const unsigned char* buffer, size_t size, xc_parse_data* da
         }
 
         if (seq_and_pri != -1)
-	    data->ack(data->user_data, msg->pt_status.type != MGW_STT_ERROR, seq_and_pri >> 4, extra);
+	    data->ack(data->user_data, buffer[XC_STATUS_TYPE] != MGW_STT_ERROR, seq_and_pri >> 4, extra, error);
 
 	break;
     }
@@ -214,65 +253,79 @@ void xc_parse_packet(const unsigned char* buffer, size_t size, xc_parse_data* da
 	break;
 
     default:
-	printf("unprocessed: received %02x: %d\n", msg->type, msg->message_size);
+	printf("unprocessed: received %02x: %d\n", buffer[XC_MSG_TYPE], buffer[XC_MSG_SIZE]);
 	break;
     }
 }
 
+static void xc_make_tx_msg(char* buffer, int datapoint, mci_tx_event event, int value, int seq_no)
+{
+    unsigned char* message = (unsigned char*) buffer;
+
+    message[XC_MSG_SIZE] = 0x9;
+    message[XC_MSG_TYPE] = MGW_PT_TX;
+    message[XC_TX_DATAPOINT] = datapoint;
+    message[XC_TX_EVENT] = event;
+    xc_store_le32(message + XC_TX_VALUE, value);
+    message[XC_TX_SEQ_AND_PRI] = seq_no << 4;
+}
+
 void xc_make_jalo_msg(char* buffer, int datapoint, mci_sb_command cmd, int seq_no)
 {
-    struct xc_ci_message* message = (struct xc_ci_message*) buffer;
-
-    message->message_size = 0x9;
-    message->type = MGW_PT_TX;
-    message->packet_tx.datapoint = datapoint;
-    message->packet_tx.tx_event = MGW_TE_JALO;
-    message->packet_tx.value = cmd;
-    message->packet_tx.seq_and_pri = seq_no << 4;
+    xc_make_tx_msg(buffer, datapoint, MGW_TE_JALO, cmd, seq_no);
 }
 
 void xc_make_dim_msg(char* buffer, int datapoint, int value, int seq_no)
 {
-    struct xc_ci_message* message = (struct xc_ci_message*) buffer;
-
-    message->message_size = 0x9;
-    message->type = MGW_PT_TX;
-    message->packet_tx.datapoint = datapoint;
-    message->packet_tx.tx_event = MGW_TE_DIM;
-    message->packet_tx.value = (value << 8) + 0x40;
-    message->packet_tx.seq_and_pri = seq_no << 4;
+    xc_make_tx_msg(buffer, datapoint, MGW_TE_DIM, (value << 8) + 0x40, seq_no);
 }
 
 void xc_make_switch_msg(char* buffer, int datapoint, int on, int seq_no)
 {
-    struct xc_ci_message* message = (struct xc_ci_message*) buffer;
-
-    message->message_size = 0x9;
-    message->type = MGW_PT_TX;
-    message->packet_tx.datapoint = datapoint;
-    message->packet_tx.tx_event = MGW_TE_SWITCH;
-    message->packet_tx.value = on;
-    message->packet_tx.seq_and_pri = seq_no << 4;
+    xc_make_tx_msg(buffer, datapoint, MGW_TE_SWITCH, on, seq_no);
 }
 
 void xc_make_request_msg (char* buffer, int datapoint, int seq_no)
 {
-    struct xc_ci_message* message = (struct xc_ci_message*) buffer;
-
-    message->message_size = 0x9;
-    message->type = MGW_PT_TX;
-    message->packet_tx.datapoint = datapoint;
-    message->packet_tx.tx_event = MGW_TE_REQUEST;
-    message->packet_tx.seq_and_pri = seq_no << 4;
+    xc_make_tx_msg(buffer, datapoint, MGW_TE_REQUEST, 0, seq_no);
 }
 
 void xc_make_config_msg(char* buffer, int type, int mode)
 {
-    struct xc_ci_message* message = (struct xc_ci_message*) buffer;
+    unsigned char* message = (unsigned char*) buffer;
 
-    message->message_size = 0x4;
-    message->type = MGW_PT_CONFIG;
-    message->pt_config.type = type;
-    message->pt_config.mode = mode;
+    message[XC_MSG_SIZE] = 0x4;
+    message[XC_MSG_TYPE] = MGW_PT_CONFIG;
+    message[XC_CONFIG_TYPE] = type;
+    message[XC_CONFIG_MODE] = mode;
 }
 
+
+void xc_make_rx_msg(char* buffer, int datapoint, enum mci_rx_event event,
+		    enum mci_rx_datatype data_type, int value, int rssi,
+		    enum mgw_rx_battery battery, int seq_no)
+{
+    unsigned char* message = (unsigned char*) buffer;
+
+    message[XC_MSG_SIZE] = 0xd;
+    message[XC_MSG_TYPE] = MGW_PT_RX;
+    message[XC_RX_DATAPOINT] = datapoint;
+    message[XC_RX_EVENT] = event;
+    message[XC_RX_DATA_TYPE] = data_type;
+    xc_store_le32(message + XC_RX_VALUE, value);
+    message[XC_RX_UNKNOWN] = 0;
+    message[XC_RX_RSSI] = rssi;
+    message[XC_RX_BATTERY] = battery;
+    message[XC_RX_SEQ_NO] = seq_no;
+}
+
+void xc_make_status_msg(char* buffer, int type, int status, int data)
+{
+    unsigned char* message = (unsigned char*) buffer;
+
+    message[XC_MSG_SIZE] = 0x8;
+    message[XC_MSG_TYPE] = MGW_PT_STATUS;
+    message[XC_STATUS_TYPE] = type;
+    message[XC_STATUS_STATUS] = status;
+    xc_store_le32(message + XC_STATUS_DATA, data);
+}
@@ -12,6 +12,8 @@
 #ifndef _CKOZ0014_H_
 #define _CKOZ0014_H_
 
+#include <stddef.h>
+
 // Known commands that the CKOZ 00/14 understands
 
 enum mci_pt_action
@@ -253,6 +255,34 @@ struct xc_ci_message
 
 #pragma pack(pop)
 
+/* Byte offsets of the fields above.  Multi-byte fields are little
+   endian and unaligned; they're read and written with the helpers in
+   wire.h, not through the struct. */
+
+#define XC_MSG_SIZE		0
+#define XC_MSG_TYPE		1
+
+#define XC_TX_DATAPOINT		2
+#define XC_TX_EVENT		3
+#define XC_TX_VALUE		4
+#define XC_TX_SEQ_AND_PRI	8
+
+#define XC_CONFIG_TYPE		2
+#define XC_CONFIG_MODE		3
+
+#define XC_RX_DATAPOINT		2
+#define XC_RX_EVENT		3
+#define XC_RX_DATA_TYPE		4
+#define XC_RX_VALUE		5
+#define XC_RX_UNKNOWN		9
+#define XC_RX_RSSI		10
+#define XC_RX_BATTERY		11
+#define XC_RX_SEQ_NO		12
+
+#define XC_STATUS_TYPE		2
+#define XC_STATUS_STATUS	3
+#define XC_STATUS_DATA		4
+
 typedef void (*xc_recv_fn)(void* user_data,
 			   enum mci_rx_event,
 			   int,
@@ -262,10 +292,13 @@ typedef void (*xc_recv_fn)(void* user_data,
 			   enum mgw_rx_battery,
 			   int);
 
+/* error is one of mstt_error when success is false, otherwise -1 */
+
 typedef void (*xc_ack_fn)(void* user_data,
 			  int success,
 			  int seq_no,
-			  int extra);
+			  int extra,
+			  int error);
 
 typedef void (*xc_relno_fn)(void* user_data,
 			    int status,
@@ -274,10 +307,18 @@ typedef void (*xc_relno_fn)(void* user_data,
 			    unsigned int usb_major,
 			    unsigned int usb_minor);
 
+/* Replies to the MGW_CT_COUNTER_RX, MGW_CT_COUNTER_TX, MGW_CT_SERIAL
+   and MGW_CT_TIMEACCOUNT queries; type is the query */
+
+typedef void (*xc_info_fn)(void* user_data,
+			   int type,
+			   unsigned int value);
+
 struct xc_parse_data {
     xc_ack_fn ack;
     xc_recv_fn recv;
     xc_relno_fn relno;
+    xc_info_fn info;
     void* user_data;
 };
 
@@ -288,6 +329,7 @@ const char* xc_shutter_status_name(int state);
 const char* xc_rssi_status_name(int rssi);
 const char* xc_battery_status_name(enum mgw_rx_battery state);
 const char* xc_rxevent_name(enum mci_rx_event event);
+const char* xc_txevent_name(enum mci_tx_event event);
 
 void xc_make_jalo_msg(char* buffer, int datapoint, mci_sb_command cmd, int message_id);
 void xc_make_dim_msg(char* buffer, int datapoint, int value, int message_id);
@@ -295,4 +337,11 @@ void xc_make_switch_msg(char* buffer, int datapoint, int on, int message_id);
 void xc_make_request_msg(char* buffer, int datapoint, int message_id);
 void xc_make_config_msg(char* buffer, int type, int mode);
 
+// Messages sent by the stick; for emulating it
+
+void xc_make_rx_msg(char* buffer, int datapoint, enum mci_rx_event event,
+		    enum mci_rx_datatype data_type, int value, int rssi,
+		    enum mgw_rx_battery battery, int seq_no);
+void xc_make_status_msg(char* buffer, int type, int status, int data);
+
 #endif
@@ -0,0 +1,31 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include <time.h>
+
+#include "clock.h"
+
+int64_t
+MonotonicClock::Now() const
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &tp);
+    return (int64_t(tp.tv_sec) * 1000) + (tp.tv_nsec / 1000000);
+}
+
+int64_t
+MonotonicClock::Lag()
+{
+    struct timespec tp;
+
+    if (clock_getres(CLOCK_MONOTONIC_COARSE, &tp) < 0)
+	return 0;
+
+    return (int64_t(tp.tv_sec) * 1000000000) + tp.tv_nsec;
+}
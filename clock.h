@@ -0,0 +1,61 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include <stdint.h>
+
+// Monotonic time in milliseconds, for all timeouts and schedules
+
+class Clock
+{
+public:
+
+    virtual ~Clock() {}
+
+    virtual int64_t Now() const = 0;
+};
+
+// The system's monotonic clock
+
+class MonotonicClock
+    : public Clock
+{
+public:
+
+    virtual int64_t Now() const;
+
+    /* How far Now() can lag behind the precise monotonic clock, in
+       ns; it's read from the coarse clock, which only moves once a
+       tick. */
+
+    static int64_t Lag();
+};
+
+/* A clock that only moves when told to, so that hours of retries,
+   timeouts and reconnects can be run through in an instant. */
+
+class SimulatedClock
+    : public Clock
+{
+public:
+
+    SimulatedClock(int64_t start = 0) : now(start) {}
+
+    virtual int64_t Now() const { return now; }
+
+    void Advance(int64_t ms) { if (ms > 0) now += ms; }
+    void Set(int64_t time) { if (time > now) now = time; }
+
+private:
+
+    int64_t now;
+};
+
+#endif
@@ -0,0 +1,204 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+static const char* device_type_names[] =
+{
+    "unknown",
+    "switch",
+    "dimmer",
+    "shutter"
+};
+
+const char*
+device_type_name(device_type type)
+{
+    return device_type_names[type];
+}
+
+gateway_config::gateway_config()
+    : topic_prefix("xcomfort"),
+      qos(1),
+      retain(true),
+      subscribe_qos(0),
+      coalesce_window(0),
+      max_in_flight(1),
+      retries(5),
+      quarantine(5000),
+      stats_interval(60),
+      poll_budget(8),
+      health_interval(30),
+      watchdog_failures(10),
+      watchdog_silence(20)
+{
+}
+
+static char*
+trim(char* s)
+{
+    while (isspace((unsigned char) *s))
+	s++;
+
+    char* end = s + strlen(s);
+
+    while (end > s && isspace((unsigned char) end[-1]))
+	*--end = 0;
+
+    return s;
+}
+
+static bool
+parse_int(const char* value, int min, int max, int& result)
+{
+    char* end;
+
+    errno = 0;
+    long parsed = strtol(value, &end, 10);
+
+    if (errno || end == value || *end || parsed < min || parsed > max)
+	return false;
+
+    result = parsed;
+    return true;
+}
+
+static bool
+parse_bool(const char* value, bool& result)
+{
+    if (strcmp(value, "true") == 0 || strcmp(value, "1") == 0)
+	result = true;
+    else if (strcmp(value, "false") == 0 || strcmp(value, "0") == 0)
+	result = false;
+    else
+	return false;
+
+    return true;
+}
+
+bool
+gateway_config::Load(const char* path, std::string& error)
+{
+    char line[256];
+    char message[512];
+    int line_no = 0;
+
+    FILE* file = fopen(path, "re");
+
+    if (!file)
+    {
+	snprintf(message, sizeof(message), "%s: %s\n", path, strerror(errno));
+	error = message;
+	return false;
+    }
+
+    // Parsed into a copy, so that a broken file changes nothing
+
+    gateway_config result = *this;
+
+    // Devices only come from the file, so removing one takes effect
+
+    result.devices.clear();
+
+    error.clear();
+
+    while (fgets(line, sizeof(line), file))
+    {
+	line_no++;
+
+	char* comment = strchr(line, '#');
+
+	if (comment)
+	    *comment = 0;
+
+	char* key = trim(line);
+
+	if (!*key)
+	    continue;
+
+	char* equals = strchr(key, '=');
+	bool valid = equals != NULL;
+
+	if (valid)
+	{
+	    *equals = 0;
+
+	    char* value = trim(equals + 1);
+	    int datapoint;
+
+	    key = trim(key);
+
+	    if (strcmp(key, "topic_prefix") == 0)
+	    {
+		// The prefix can't contain wildcards or be empty
+
+		valid = *value && !strpbrk(value, "+#") && value[strlen(value) - 1] != '/';
+		if (valid)
+		    result.topic_prefix = value;
+	    }
+	    else if (strcmp(key, "qos") == 0)
+		valid = parse_int(value, 0, 2, result.qos);
+	    else if (strcmp(key, "retain") == 0)
+		valid = parse_bool(value, result.retain);
+	    else if (strcmp(key, "subscribe_qos") == 0)
+		valid = parse_int(value, 0, 2, result.subscribe_qos);
+	    else if (strcmp(key, "coalesce") == 0)
+		valid = parse_int(value, 0, 60000, result.coalesce_window);
+	    else if (strcmp(key, "max_in_flight") == 0)
+		valid = parse_int(value, 1, 15, result.max_in_flight);
+	    else if (strcmp(key, "retries") == 0)
+		valid = parse_int(value, 1, 100, result.retries);
+	    else if (strcmp(key, "quarantine") == 0)
+		valid = parse_int(value, 0, 600000, result.quarantine);
+	    else if (strcmp(key, "stats_interval") == 0)
+		valid = parse_int(value, 0, 86400, result.stats_interval);
+	    else if (strcmp(key, "poll_budget") == 0)
+		valid = parse_int(value, 1, MAX_POLL_BUDGET, result.poll_budget);
+	    else if (strcmp(key, "health_interval") == 0)
+		valid = parse_int(value, 0, 86400, result.health_interval);
+	    else if (strcmp(key, "watchdog_failures") == 0)
+		valid = parse_int(value, 0, 1000, result.watchdog_failures);
+	    else if (strcmp(key, "watchdog_silence") == 0)
+		valid = parse_int(value, 0, 3600, result.watchdog_silence);
+	    else if (sscanf(key, "device %d", &datapoint) == 1 && datapoint >= 0 && datapoint <= 255)
+	    {
+		valid = false;
+
+		for (int type = DEVICE_SWITCH; type <= DEVICE_SHUTTER; ++type)
+		    if (strcmp(value, device_type_names[type]) == 0)
+		    {
+			result.devices[datapoint] = (device_type) type;
+			valid = true;
+		    }
+	    }
+	    else
+		valid = false;
+	}
+
+	if (!valid)
+	{
+	    snprintf(message, sizeof(message), "%s:%d: invalid setting\n", path, line_no);
+	    error += message;
+	}
+    }
+
+    fclose(file);
+
+    if (!error.empty())
+	return false;
+
+    *this = result;
+
+    return true;
+}
@@ -0,0 +1,93 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include <map>
+#include <string>
+
+// Most epoll events handled per wakeup
+
+#define MAX_POLL_BUDGET		64
+
+// What's behind a datapoint, as far as the user has told us
+
+enum device_type
+{
+    DEVICE_UNKNOWN,
+    DEVICE_SWITCH,
+    DEVICE_DIMMER,
+    DEVICE_SHUTTER
+};
+
+/* Settings that can be changed while running.  The command line sets
+   the starting point, and the configuration file is read on top of
+   it at startup and on SIGHUP.  Lines are on the form "key = value";
+   '#' starts a comment.  Devices are given as eg. "device 12 = dimmer". */
+
+struct gateway_config
+{
+    gateway_config();
+
+    // Read the file on top of the current settings.  Nothing is
+    // changed if the file has errors; they are described in error
+
+    bool Load(const char* path, std::string& error);
+
+    // Topics are "<topic_prefix>/<datapoint>/..."
+
+    std::string topic_prefix;
+
+    // QoS and retain flag for published states, and QoS for the
+    // command subscription
+
+    int qos;
+    bool retain;
+    int subscribe_qos;
+
+    // Minimum time in ms between messages to the same datapoint
+
+    int coalesce_window;
+
+    // Messages to the stick awaiting an ack at the same time
+
+    int max_in_flight;
+
+    // Messages sent per change before giving up
+
+    int retries;
+
+    // Time in ms a sequence number is kept unused after a timeout
+
+    int quarantine;
+
+    // Seconds between publishing statistics, 0 to disable
+
+    int stats_interval;
+
+    // Epoll events handled per wakeup of the event loop
+
+    int poll_budget;
+
+    // Seconds between asking the stick about its health, 0 to disable
+
+    int health_interval;
+
+    // Messages failing in a row, and seconds without a frame from the
+    // stick while it owes us one, before it's reset; 0 to disable
+
+    int watchdog_failures;
+    int watchdog_silence;
+
+    std::map<int, device_type> devices;
+};
+
+const char* device_type_name(device_type type);
+
+#endif
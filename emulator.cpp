@@ -0,0 +1,463 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "emulator.h"
+#include "wire.h"
+
+emulator_config::emulator_config()
+    : devices(16),
+      latency(150),
+      jitter(50),
+      loss(0),
+      busy(0),
+      status_rate(0),
+      wedge(0),
+      seed(1)
+{
+}
+
+bool
+emulator_config::Parse(char* options)
+{
+    enum { DEVICES, LATENCY, JITTER, LOSS, BUSY, STATUS, WEDGE, SEED };
+
+    static char* const tokens[] =
+    {
+	(char*) "devices",
+	(char*) "latency",
+	(char*) "jitter",
+	(char*) "loss",
+	(char*) "busy",
+	(char*) "status",
+	(char*) "wedge",
+	(char*) "seed",
+	NULL
+    };
+
+    char* value;
+
+    while (*options)
+    {
+	int token = getsubopt(&options, tokens, &value);
+
+	if (token == -1 || !value)
+	    return false;
+
+	switch (token)
+	{
+	case DEVICES: devices = atoi(value); break;
+	case LATENCY: latency = atoi(value); break;
+	case JITTER:  jitter = atoi(value); break;
+	case LOSS:    loss = atof(value); break;
+	case BUSY:    busy = atof(value); break;
+	case STATUS:  status_rate = atof(value); break;
+	case WEDGE:   wedge = atoi(value); break;
+	case SEED:    seed = strtoul(value, NULL, 10); break;
+	}
+    }
+
+    if (devices > 255)
+	devices = 255;
+
+    return true;
+}
+
+EmulatedStick::EmulatedStick(const emulator_config& config, Clock* clock)
+    : config(config),
+      clock(clock ? clock : &monotonic_clock),
+      epoll_fd(-1),
+      timer_fd(-1),
+      listener(NULL),
+      rx_seq_no(0),
+      frames_sent(0),
+      frames_received(0),
+      rf_rx(0),
+      rf_tx(0),
+      wedge_time(INT64_MAX),
+      random(config.seed)
+{
+    for (int i = 0; i < 256; ++i)
+	values[i] = 0;
+}
+
+bool
+EmulatedStick::Init(int fd, TransportListener* listener)
+{
+    epoll_event event;
+
+    epoll_fd = fd;
+    this->listener = listener;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0)
+    {
+	listener->Error("timerfd_create failed %s\n", strerror(errno));
+	return false;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = this;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) < 0)
+    {
+	listener->Error("epoll_ctl failed %s\n", strerror(errno));
+	return false;
+    }
+
+    listener->Info("emulating CKOZ-00/14 with %d devices\n", config.devices);
+
+    if (config.wedge > 0)
+	wedge_time = clock->Now() + config.wedge * 1000;
+
+    ScheduleStatus(clock->Now());
+
+    return true;
+}
+
+void
+EmulatedStick::Stop()
+{
+    if (timer_fd != -1)
+    {
+	close(timer_fd);
+	timer_fd = -1;
+    }
+
+    events.clear();
+}
+
+int
+EmulatedStick::DeviceValue(int datapoint) const
+{
+    if (datapoint < 1 || datapoint > config.devices)
+	return -1;
+
+    return values[datapoint];
+}
+
+int64_t
+EmulatedStick::NextEvent() const
+{
+    if (events.empty())
+	return INT64_MAX;
+
+    return events.begin()->first;
+}
+
+int
+EmulatedStick::Latency()
+{
+    if (config.jitter <= 0)
+	return config.latency;
+
+    return config.latency + std::uniform_int_distribution<int>(0, config.jitter)(random);
+}
+
+bool
+EmulatedStick::Chance(double probability)
+{
+    return probability > 0 && std::uniform_real_distribution<double>(0, 1)(random) < probability;
+}
+
+void
+EmulatedStick::Schedule(int64_t time, event_type type, const char* frame)
+{
+    pending_event event;
+
+    event.type = type;
+    memset(event.frame, 0, sizeof(event.frame));
+
+    if (frame)
+	memcpy(event.frame, frame, sizeof(event.frame));
+
+    events.insert(std::make_pair(time, event));
+
+    Rearm();
+}
+
+void
+EmulatedStick::ScheduleStatus(int64_t current_time)
+{
+    if (config.status_rate <= 0 || config.devices <= 0)
+	return;
+
+    // Poisson process
+
+    std::exponential_distribution<double> interval(config.status_rate);
+
+    Schedule(current_time + int64_t(interval(random) * 1000), EMULATOR_STATUS);
+}
+
+void
+EmulatedStick::Rearm()
+{
+    itimerspec timer;
+
+    memset(&timer, 0, sizeof(timer));
+
+    if (!events.empty())
+    {
+	int64_t delay = events.begin()->first - clock->Now();
+
+	if (delay > 0)
+	{
+	    timer.it_value.tv_sec = delay / 1000;
+	    timer.it_value.tv_nsec = (delay % 1000) * 1000000;
+	}
+	else
+	    // Zero would disarm the timer
+
+	    timer.it_value.tv_nsec = 1;
+    }
+
+    timerfd_settime(timer_fd, 0, &timer, NULL);
+}
+
+void
+EmulatedStick::Ack(int64_t time, int seq_no)
+{
+    char frame[INTR_RECV_LENGTH];
+
+    memset(frame, 0, sizeof(frame));
+    xc_make_status_msg(frame, MGW_STT_OK, 0, seq_no << 4);
+    Schedule(time, EMULATOR_FRAME, frame);
+}
+
+void
+EmulatedStick::Fail(int64_t time, int error, int seq_no)
+{
+    char frame[INTR_RECV_LENGTH];
+
+    memset(frame, 0, sizeof(frame));
+
+    if (error == MGW_STS_NO_ACK)
+	xc_make_status_msg(frame, MGW_STT_ERROR, error, seq_no << 4);
+    else
+	xc_make_status_msg(frame, MGW_STT_ERROR, error, (seq_no << 4) << 8);
+
+    Schedule(time, EMULATOR_FRAME, frame);
+}
+
+void
+EmulatedStick::Status(int64_t time, int datapoint)
+{
+    char frame[INTR_RECV_LENGTH];
+
+    memset(frame, 0, sizeof(frame));
+    xc_make_rx_msg(frame, datapoint, MSG_STATUS, PERCENT, values[datapoint],
+		   60, MGW_RB_PWR, rx_seq_no);
+
+    rf_rx++;
+
+    rx_seq_no = (rx_seq_no + 1) & 0xf;
+
+    Schedule(time, EMULATOR_FRAME, frame);
+}
+
+void
+EmulatedStick::Transmit(const unsigned char* frame, int64_t current_time)
+{
+    int datapoint = frame[XC_TX_DATAPOINT];
+    int seq_no = frame[XC_TX_SEQ_AND_PRI] >> 4;
+    int value = (int32_t) xc_load_le32(frame + XC_TX_VALUE);
+
+    if (datapoint < 1 || datapoint > config.devices)
+    {
+	Fail(current_time, MGW_STS_DP_OOR, seq_no);
+	return;
+    }
+
+    if (Chance(config.busy))
+    {
+	Fail(current_time, MGW_STS_BUSY_MRF, seq_no);
+	return;
+    }
+
+    rf_tx++;
+
+    if (Chance(config.loss))
+	return;
+
+    int64_t acked = current_time + Latency();
+
+    switch (frame[XC_TX_EVENT])
+    {
+    case MGW_TE_SWITCH:
+	values[datapoint] = value ? 100 : 0;
+	break;
+
+    case MGW_TE_DIM:
+	values[datapoint] = value >> 8;
+	break;
+
+    case MGW_TE_JALO:
+	values[datapoint] = value == MGW_TED_OPEN ? SHUTTER_UP : value == MGW_TED_CLOSE ? SHUTTER_DOWN : SHUTTER_STOPPED;
+	break;
+
+    case MGW_TE_REQUEST:
+	// The device answers once it has been reached
+
+	Status(acked + Latency(), datapoint);
+	break;
+
+    default:
+	break;
+    }
+
+    Ack(acked, seq_no);
+}
+
+int
+EmulatedStick::Send(const unsigned char* buffer, size_t length)
+{
+    int64_t current_time = clock->Now();
+
+    frames_sent++;
+
+    // The USB transfer itself completes right away
+
+    Schedule(current_time, EMULATOR_SENT);
+
+    if (current_time >= wedge_time)
+	// Hung; frames are taken, but nothing happens
+
+	return 0;
+
+    switch (buffer[XC_MSG_TYPE])
+    {
+    case MGW_PT_TX:
+	Transmit(buffer, current_time);
+	break;
+
+    case MGW_PT_CONFIG:
+	Configure(buffer, current_time);
+	break;
+
+    default:
+	break;
+    }
+
+    return 0;
+}
+
+void
+EmulatedStick::Configure(const unsigned char* buffer, int64_t current_time)
+{
+    char frame[INTR_RECV_LENGTH];
+
+    memset(frame, 0, sizeof(frame));
+
+    switch (buffer[XC_CONFIG_TYPE])
+    {
+    case MGW_CT_RELEASE:
+	// RF V2.10, USB V2.05
+
+	xc_make_status_msg(frame, MGW_STT_RELEASE, 0, 2 | (10 << 8) | (2 << 16) | (5 << 24));
+	break;
+
+    case MGW_CT_COUNTER_RX:
+	xc_make_status_msg(frame, MGW_CT_COUNTER_RX, 0, rf_rx);
+	break;
+
+    case MGW_CT_COUNTER_TX:
+	xc_make_status_msg(frame, MGW_CT_COUNTER_TX, 0, rf_tx);
+	break;
+
+    case MGW_CT_SERIAL:
+	xc_make_status_msg(frame, MGW_STT_SERIAL, 0, config.seed);
+	break;
+
+    case MGW_CT_TIMEACCOUNT:
+	// The stick reports how much of its transmit time is left
+
+	xc_make_status_msg(frame, MGW_STT_TIMEACCOUNT, 0, 100);
+	break;
+
+    default:
+	xc_make_status_msg(frame, MGW_STT_OK, 0, 0);
+	break;
+    }
+
+    Schedule(current_time + 1, EMULATOR_FRAME, frame);
+}
+
+void
+EmulatedStick::Reset()
+{
+    int64_t current_time = clock->Now();
+
+    // Everything in flight is lost; the stick comes back after
+    // enumerating again, with its counters cleared
+
+    events.clear();
+
+    listener->TransportLost();
+
+    rf_rx = rf_tx = 0;
+    wedge_time = INT64_MAX;
+
+    Schedule(current_time + EMULATOR_RESET_TIME, EMULATOR_RESTORED);
+    ScheduleStatus(current_time);
+}
+
+void
+EmulatedStick::Poll(const epoll_event& event)
+{
+    uint64_t expirations;
+    int64_t current_time = clock->Now();
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+	listener->Error("timerfd read failed %s\n", strerror(errno));
+
+    while (!events.empty() && events.begin()->first <= current_time)
+    {
+	pending_event pending = events.begin()->second;
+
+	events.erase(events.begin());
+
+	switch (pending.type)
+	{
+	case EMULATOR_SENT:
+	    listener->FrameSent();
+	    break;
+
+	case EMULATOR_FRAME:
+	    if (current_time >= wedge_time)
+		break;
+
+	    frames_received++;
+	    listener->FrameReceived(pending.frame, sizeof(pending.frame));
+	    break;
+
+	case EMULATOR_RESTORED:
+	    listener->TransportRestored();
+	    break;
+
+	case EMULATOR_STATUS:
+	    {
+		int datapoint = std::uniform_int_distribution<int>(1, config.devices)(random);
+
+		values[datapoint] = std::uniform_int_distribution<int>(0, 100)(random);
+
+		Status(current_time, datapoint);
+		ScheduleStatus(current_time);
+	    }
+	    break;
+	}
+    }
+
+    Rearm();
+}
@@ -0,0 +1,162 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _EMULATOR_H_
+#define _EMULATOR_H_
+
+#include <stdint.h>
+#include <map>
+#include <random>
+
+#include "ckoz0014.h"
+#include "clock.h"
+#include "transport.h"
+
+struct emulator_config
+{
+    emulator_config();
+
+    // Parse a comma separated list of key=value; false on error
+
+    bool Parse(char* options);
+
+    // Datapoints 1 to devices have a device behind them
+
+    int devices;
+
+    // Time in ms until a message is acked, plus random jitter
+
+    int latency;
+    int jitter;
+
+    // Probability that a message is never acked
+
+    double loss;
+
+    // Probability that a message is rejected with MGW_STS_BUSY_MRF
+
+    double busy;
+
+    // Spontaneous MSG_STATUS messages per second, across all devices
+
+    double status_rate;
+
+    // Seconds after starting until the stick stops answering, as if
+    // its firmware hung, until it's reset; 0 for never
+
+    int wedge;
+
+    unsigned int seed;
+};
+
+// Time in ms the stick is gone while it's being reset
+
+#define EMULATOR_RESET_TIME	100
+
+/* This class emulates a CKOZ-00/14 with a number of devices behind
+   it, for testing and benchmarking without hardware. */
+
+class EmulatedStick
+    : public Transport
+{
+public:
+
+    EmulatedStick(const emulator_config& config, Clock* clock = NULL);
+
+    virtual bool Init(int epoll_fd, TransportListener* listener);
+    virtual void Stop();
+
+    virtual void Poll(const epoll_event& event);
+
+    virtual int Send(const unsigned char* buffer, size_t length);
+
+    virtual void Reset();
+
+    // Current value of a device, or -1 if there's none
+
+    int DeviceValue(int datapoint) const;
+
+    // Frames sent and received so far
+
+    uint64_t FramesSent() const { return frames_sent; }
+    uint64_t FramesReceived() const { return frames_received; }
+
+    /* Time of the next event, or INT64_MAX if there's none.  With a
+       simulated clock, the timer never fires when it should; the
+       clock is stepped to this time and Poll() called instead (see
+       sim.cpp). */
+
+    int64_t NextEvent() const;
+
+private:
+
+    enum event_type
+    {
+	EMULATOR_SENT,
+	EMULATOR_FRAME,
+	EMULATOR_STATUS,
+	EMULATOR_RESTORED
+    };
+
+    struct pending_event
+    {
+	event_type type;
+	unsigned char frame[INTR_RECV_LENGTH];
+    };
+
+    void Schedule(int64_t time, event_type type, const char* frame = NULL);
+    void ScheduleStatus(int64_t current_time);
+    void Rearm();
+
+    void Transmit(const unsigned char* frame, int64_t current_time);
+    void Configure(const unsigned char* frame, int64_t current_time);
+    void Ack(int64_t time, int seq_no);
+    void Fail(int64_t time, int error, int seq_no);
+    void Status(int64_t time, int datapoint);
+
+    int Latency();
+    bool Chance(double probability);
+
+    emulator_config config;
+
+    MonotonicClock monotonic_clock;
+    Clock* clock;
+
+    int epoll_fd;
+    int timer_fd;
+
+    TransportListener* listener;
+
+    // Events in the order they're due
+
+    std::multimap<int64_t, pending_event> events;
+
+    // Device states, indexed by datapoint
+
+    int values[256];
+
+    // Sequence number of the messages from the devices
+
+    int rx_seq_no;
+
+    uint64_t frames_sent;
+    uint64_t frames_received;
+
+    // What the stick counts; RF frames to and from the devices
+
+    uint32_t rf_rx;
+    uint32_t rf_tx;
+
+    // When the stick hangs, INT64_MAX if it won't
+
+    int64_t wedge_time;
+
+    std::mt19937 random;
+};
+
+#endif
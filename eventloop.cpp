@@ -0,0 +1,225 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "clock.h"
+#include "eventloop.h"
+
+static int64_t
+monotonic_ns()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (int64_t(tp.tv_sec) * 1000000000) + tp.tv_nsec;
+}
+
+static int64_t
+monotonic_ms()
+{
+    return monotonic_ns() / 1000000;
+}
+
+EventLoop::EventLoop()
+    : epoll_fd(-1),
+      timer_fd(-1),
+      signal_fd(-1),
+      wakeup_fd(-1),
+      armed(-1),
+      lag(MonotonicClock::Lag()),
+      reload(false),
+      exit_status(-1)
+{
+}
+
+EventLoop::~EventLoop()
+{
+    if (wakeup_fd != -1)
+	close(wakeup_fd);
+    if (signal_fd != -1)
+	close(signal_fd);
+    if (timer_fd != -1)
+	close(timer_fd);
+    if (epoll_fd != -1)
+	close(epoll_fd);
+}
+
+bool
+EventLoop::Init()
+{
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGHUP);
+
+    // Only delivered through the signalfd from now on
+
+    if (sigprocmask(SIG_BLOCK, &signals, NULL) < 0)
+	return false;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (epoll_fd < 0 || timer_fd < 0 || signal_fd < 0 || wakeup_fd < 0 || !notifier.Init())
+	return false;
+
+    return Add(timer_fd) && Add(signal_fd) && Add(wakeup_fd);
+}
+
+bool
+EventLoop::Add(int& fd)
+{
+    epoll_event event;
+
+    // Our descriptors are told apart by the member holding them
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &fd;
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+void
+EventLoop::Arm(int timeout)
+{
+    itimerspec timer;
+    int64_t deadline = -1;
+
+    /* Timeouts are measured with MonotonicClock, which lags this
+       clock by up to a tick.  Wake up once it's caught up, or the
+       deadline isn't quite due yet, and the wait is repeated. */
+
+    if (timeout >= 0 && timeout != INT_MAX)
+	deadline = monotonic_ns() + int64_t(timeout) * 1000000 + lag;
+
+    /* Deadlines are relative to now, so they seldom repeat; but an
+       idle gateway has none, wait after wait, and the timer can be
+       left alone. */
+
+    if (deadline == armed)
+	return;
+
+    memset(&timer, 0, sizeof(timer));
+
+    if (deadline != -1)
+    {
+	timer.it_value.tv_sec = deadline / 1000000000;
+	timer.it_value.tv_nsec = deadline % 1000000000;
+    }
+
+    // A zero timer disarms it
+
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+    armed = deadline;
+}
+
+int
+EventLoop::Wait(int timeout, epoll_event* events, int max_events)
+{
+    uint64_t count;
+    int ready;
+    int kept = 0;
+
+    if (Exiting())
+	return 0;
+
+    int64_t current_time = monotonic_ms();
+    int64_t ping = notifier.Ping(current_time);
+
+    if (ping != INT64_MAX && (timeout < 0 || timeout == INT_MAX || timeout > ping - current_time))
+	timeout = int(ping - current_time);
+
+    if (timeout == 0)
+	// Due already; just collect whatever is ready
+
+	ready = epoll_wait(epoll_fd, events, max_events, 0);
+    else
+    {
+	Arm(timeout);
+
+	ready = epoll_wait(epoll_fd, events, max_events, -1);
+    }
+
+    if (ready < 0)
+    {
+	if (errno != EINTR)
+	    Exit(EXIT_FAILURE);
+
+	return 0;
+    }
+
+    for (int i = 0; i < ready; ++i)
+    {
+	if (events[i].data.ptr == &timer_fd)
+	{
+	    if (read(timer_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror("read");
+
+	    armed = -1;
+	}
+	else if (events[i].data.ptr == &signal_fd)
+	{
+	    signalfd_siginfo info;
+
+	    while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+		if (info.ssi_signo == SIGHUP)
+		    reload = true;
+		else
+		    Exit(EXIT_SUCCESS);
+	}
+	else if (events[i].data.ptr == &wakeup_fd)
+	{
+	    if (read(wakeup_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror("read");
+	}
+	else
+	    // For the caller
+
+	    events[kept++] = events[i];
+    }
+
+    return kept;
+}
+
+void
+EventLoop::Exit(int status)
+{
+    // The first reason to exit is the one reported
+
+    int running = -1;
+
+    exit_status.compare_exchange_strong(running, status);
+
+    Wakeup();
+}
+
+void
+EventLoop::Wakeup()
+{
+    uint64_t one = 1;
+
+    if (wakeup_fd != -1 && write(wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	perror("write");
+}
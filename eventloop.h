@@ -0,0 +1,95 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _EVENTLOOP_H_
+#define _EVENTLOOP_H_
+
+#include <stdint.h>
+#include <atomic>
+
+#include "notify.h"
+
+struct epoll_event;
+
+/* This class owns the epoll set everything waits in, and the
+   descriptors that drive it: a timerfd for the next deadline, a
+   signalfd for SIGTERM, SIGQUIT and SIGHUP, and an eventfd that other
+   threads can wake the loop with.  All waiting is a single blocking
+   epoll_wait(), so an idle gateway doesn't wake up at all.
+
+   The signals are blocked for the whole process, so Init() has to be
+   called before any threads are started.
+
+   When run by systemd, the watchdog pings are sent from here, so
+   they stop if the loop stops turning. */
+
+class EventLoop
+{
+public:
+
+    EventLoop();
+    ~EventLoop();
+
+    bool Init();
+
+    int Fd() const { return epoll_fd; }
+
+    /* Wait for events, or until timeout ms have passed; negative
+       waits forever.  Up to max_events are collected in one go, and
+       the number of them that are for the caller is returned; the
+       loop's own descriptors are handled here.  SIGTERM and SIGQUIT
+       make the loop exit. */
+
+    int Wait(int timeout, epoll_event* events, int max_events);
+
+    // True once after SIGHUP
+
+    bool TakeReload() { bool requested = reload; reload = false; return requested; }
+
+    // Stop the loop with the given exit status; from any thread
+
+    void Exit(int status);
+
+    bool Exiting() const { return exit_status.load() != -1; }
+    int ExitStatus() const { return exit_status.load(); }
+
+    // Wake the loop from another thread
+
+    void Wakeup();
+
+    ServiceNotifier& Notifier() { return notifier; }
+
+private:
+
+    bool Add(int& fd);
+    void Arm(int timeout);
+
+    int epoll_fd;
+    int timer_fd;
+    int signal_fd;
+    int wakeup_fd;
+
+    // Absolute CLOCK_MONOTONIC deadline the timer is armed for, in
+    // ns; -1 when disarmed
+
+    int64_t armed;
+
+    // Added to deadlines, so the gateway's clock has reached them too
+
+    int64_t lag;
+
+    bool reload;
+
+    ServiceNotifier notifier;
+
+    // -1 until Exit() is called
+
+    std::atomic<int> exit_status;
+};
+
+#endif
@@ -0,0 +1,564 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+/*
+ *  Fuzz target and property checks for the protocol decoder and
+ *  encoders.
+ *
+ *  Built with -DXC_LIBFUZZER, this is a libFuzzer target.  Otherwise
+ *  it's a standalone program that runs the property checks, then
+ *  feeds the files given on the command line, or random frames, to
+ *  the decoder.  In the standalone program, each input is placed
+ *  right before an inaccessible page, so reading past its end
+ *  crashes without the help of a sanitizer.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <random>
+#include <vector>
+
+#include "ckoz0014.h"
+#include "transport.h"
+#include "wire.h"
+
+static int failures;
+
+#define CHECK(condition)						\
+    do {								\
+	if (!(condition))						\
+	{								\
+	    fprintf(stderr, "%s:%d: check failed: %s\n",		\
+		    __FILE__, __LINE__, #condition);			\
+	    failures++;							\
+	}								\
+    } while (0)
+
+// What the decoder reported for the last frame
+
+struct decoded
+{
+    int calls;
+
+    int rx_event;
+    int datapoint;
+    int data_type;
+    int value;
+    int rssi;
+    int battery;
+    int rx_seq_no;
+
+    int success;
+    int seq_no;
+    int extra;
+    int error;
+
+    int status;
+    unsigned int version[4];
+};
+
+static void
+recv_fn(void* user_data, mci_rx_event event, int datapoint, mci_rx_datatype data_type,
+	int value, int rssi, mgw_rx_battery battery, int seq_no)
+{
+    decoded* d = (decoded*) user_data;
+
+    d->calls++;
+    d->rx_event = event;
+    d->datapoint = datapoint;
+    d->data_type = data_type;
+    d->value = value;
+    d->rssi = rssi;
+    d->battery = battery;
+    d->rx_seq_no = seq_no;
+}
+
+static void
+ack_fn(void* user_data, int success, int seq_no, int extra, int error)
+{
+    decoded* d = (decoded*) user_data;
+
+    d->calls++;
+    d->success = success;
+    d->seq_no = seq_no;
+    d->extra = extra;
+    d->error = error;
+}
+
+static void
+relno_fn(void* user_data, int status, unsigned int rf_major, unsigned int rf_minor,
+	 unsigned int usb_major, unsigned int usb_minor)
+{
+    decoded* d = (decoded*) user_data;
+
+    d->calls++;
+    d->status = status;
+    d->version[0] = rf_major;
+    d->version[1] = rf_minor;
+    d->version[2] = usb_major;
+    d->version[3] = usb_minor;
+}
+
+static void
+info_fn(void* user_data, int type, unsigned int value)
+{
+    decoded* d = (decoded*) user_data;
+
+    d->calls++;
+    d->status = type;
+}
+
+// Decode a frame and check what holds for any input
+
+static decoded
+decode(const unsigned char* buffer, size_t size)
+{
+    xc_parse_data data;
+    decoded d;
+
+    memset(&d, 0, sizeof(d));
+    d.seq_no = d.extra = d.error = -1;
+
+    data.recv = recv_fn;
+    data.ack = ack_fn;
+    data.relno = relno_fn;
+    data.info = info_fn;
+    data.user_data = &d;
+
+    xc_parse_packet(buffer, size, &data);
+
+    // At most one callback per frame, and only for complete frames
+
+    CHECK(d.calls <= 1);
+    CHECK(d.calls == 0 || (size >= 2 && size >= buffer[0]));
+
+    if (d.calls)
+    {
+	CHECK(d.datapoint >= 0 && d.datapoint <= 255);
+	CHECK(d.seq_no >= -1 && d.seq_no <= 15);
+	CHECK(d.extra >= -1 && d.extra <= 255);
+	CHECK(d.error >= -1 && d.error <= 255);
+	CHECK(d.success == 0 || d.error == -1);
+
+	for (int i = 0; i < 4; ++i)
+	    CHECK(d.version[i] <= 255);
+    }
+
+    return d;
+}
+
+// The load helpers work in constant expressions
+
+static constexpr unsigned char wire_bytes[] = { 0x78, 0x56, 0x34, 0x12 };
+
+static_assert(xc_load_le16(wire_bytes) == 0x5678, "little endian load");
+static_assert(xc_load_le32(wire_bytes) == 0x12345678, "little endian load");
+static_assert(xc_load_be32(wire_bytes) == 0x78563412, "big endian load");
+
+#ifdef XC_LIBFUZZER
+
+extern "C" int
+LLVMFuzzerTestOneInput(const uint8_t* input, size_t size)
+{
+    // An exact size copy, so the sanitizers see reads past the end
+
+    unsigned char* buffer = (unsigned char*) malloc(size ? size : 1);
+
+    memcpy(buffer, input, size);
+    decode(buffer, size);
+    free(buffer);
+
+    if (failures)
+	abort();
+
+    return 0;
+}
+
+#else
+
+// Memory followed by a page that can't be read
+
+class GuardedBuffer
+{
+public:
+
+    GuardedBuffer()
+    {
+	page = sysconf(_SC_PAGESIZE);
+	base = (unsigned char*) mmap(NULL, page * 2, PROT_READ | PROT_WRITE,
+				     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (base == MAP_FAILED || mprotect(base + page, page, PROT_NONE) < 0)
+	{
+	    perror("mmap");
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    ~GuardedBuffer()
+    {
+	munmap(base, page * 2);
+    }
+
+    // Place a copy of the input so that it ends at the guard page
+
+    const unsigned char* Place(const unsigned char* input, size_t size)
+    {
+	unsigned char* start = base + page - size;
+
+	memcpy(start, input, size);
+	return start;
+    }
+
+    size_t Size() const { return page; }
+
+private:
+
+    unsigned char* base;
+    size_t page;
+};
+
+static GuardedBuffer guard;
+
+static decoded
+decode_guarded(const unsigned char* input, size_t size)
+{
+    return decode(guard.Place(input, size), size);
+}
+
+// Frames to the stick: the layout the stick expects, byte by byte
+
+static void
+check_encoders()
+{
+    char frame[INTR_SEND_LENGTH];
+
+    for (int datapoint = 0; datapoint < 256; ++datapoint)
+	for (int seq_no = 0; seq_no < 16; ++seq_no)
+	{
+	    memset(frame, 0xee, sizeof(frame));
+	    xc_make_switch_msg(frame, datapoint, seq_no & 1, seq_no);
+
+	    CHECK(frame[0] == 0x09);
+	    CHECK((unsigned char) frame[1] == MGW_PT_TX);
+	    CHECK((unsigned char) frame[2] == datapoint);
+	    CHECK(frame[3] == MGW_TE_SWITCH);
+	    CHECK(frame[4] == (seq_no & 1) && frame[5] == 0 && frame[6] == 0 && frame[7] == 0);
+	    CHECK((unsigned char) frame[8] == seq_no << 4);
+	    CHECK((unsigned char) frame[9] == 0xee);
+	}
+
+    for (int value = 0; value <= 100; ++value)
+    {
+	memset(frame, 0xee, sizeof(frame));
+	xc_make_dim_msg(frame, 17, value, 5);
+
+	CHECK(frame[0] == 0x09);
+	CHECK((unsigned char) frame[1] == MGW_PT_TX);
+	CHECK(frame[2] == 17);
+	CHECK(frame[3] == MGW_TE_DIM);
+	CHECK(frame[4] == 0x40 && frame[5] == value && frame[6] == 0 && frame[7] == 0);
+	CHECK(frame[8] == 5 << 4);
+    }
+
+    memset(frame, 0xee, sizeof(frame));
+    xc_make_jalo_msg(frame, 3, MGW_TED_SETP_OPEN, 15);
+
+    CHECK(frame[0] == 0x09);
+    CHECK(frame[3] == MGW_TE_JALO);
+    CHECK(frame[4] == MGW_TED_SETP_OPEN && frame[5] == 0 && frame[6] == 0 && frame[7] == 0);
+    CHECK((unsigned char) frame[8] == 0xf0);
+
+    memset(frame, 0xee, sizeof(frame));
+    xc_make_request_msg(frame, 200, 9);
+
+    CHECK(frame[0] == 0x09);
+    CHECK((unsigned char) frame[2] == 200);
+    CHECK(frame[3] == MGW_TE_REQUEST);
+    CHECK((unsigned char) frame[8] == 0x90);
+
+    memset(frame, 0xee, sizeof(frame));
+    xc_make_config_msg(frame, MGW_CT_RELEASE, 0);
+
+    CHECK(frame[0] == 0x04);
+    CHECK((unsigned char) frame[1] == MGW_PT_CONFIG);
+    CHECK(frame[2] == MGW_CT_RELEASE && frame[3] == 0);
+    CHECK((unsigned char) frame[4] == 0xee);
+}
+
+// Byte order and alignment don't depend on the host
+
+static void
+check_wire()
+{
+    unsigned char buffer[8];
+
+    for (int offset = 0; offset < 4; ++offset)
+    {
+	memset(buffer, 0, sizeof(buffer));
+	xc_store_le32(buffer + offset, 0xa1b2c3d4);
+
+	CHECK(buffer[offset] == 0xd4 && buffer[offset + 3] == 0xa1);
+	CHECK(xc_load_le32(buffer + offset) == 0xa1b2c3d4);
+	CHECK(xc_load_be32(buffer + offset) == 0xd4c3b2a1);
+
+	xc_store_le16(buffer + offset, 0xbeef);
+
+	CHECK(buffer[offset] == 0xef && buffer[offset + 1] == 0xbe);
+	CHECK(xc_load_le16(buffer + offset) == 0xbeef);
+    }
+}
+
+static bool
+frame_is(const char* frame, const char* expected, size_t length)
+{
+    return memcmp(frame, expected, length) == 0;
+}
+
+// Complete frames, as the stick sends and receives them
+
+static void
+check_golden()
+{
+    char frame[INTR_SEND_LENGTH];
+    decoded d;
+
+    memset(frame, 0, sizeof(frame));
+    xc_make_dim_msg(frame, 17, 55, 5);
+    CHECK(frame_is(frame, "\x09\xb1\x11\x0d\x40\x37\x00\x00\x50", 9));
+
+    xc_make_switch_msg(frame, 200, 1, 15);
+    CHECK(frame_is(frame, "\x09\xb1\xc8\x0a\x01\x00\x00\x00\xf0", 9));
+
+    xc_make_jalo_msg(frame, 3, MGW_TED_SETP_OPEN, 1);
+    CHECK(frame_is(frame, "\x09\xb1\x03\x0e\x11\x00\x00\x00\x10", 9));
+
+    xc_make_request_msg(frame, 9, 2);
+    CHECK(frame_is(frame, "\x09\xb1\x09\x0b\x00\x00\x00\x00\x20", 9));
+
+    xc_make_config_msg(frame, MGW_CT_RELEASE, 0);
+    CHECK(frame_is(frame, "\x04\xb2\x1b\x00", 4));
+
+    xc_make_rx_msg(frame, 12, MSG_STATUS, PERCENT, 0x01020304, 60, MGW_RB_PWR, 3);
+    CHECK(frame_is(frame, "\x0d\xc1\x0c\x70\x01\x04\x03\x02\x01\x00\x3c\x10\x03", 13));
+
+    xc_make_status_msg(frame, MGW_STT_OK, 0, 0x5a70);
+    CHECK(frame_is(frame, "\x08\xc3\x1c\x00\x70\x5a\x00\x00", 8));
+
+    d = decode_guarded((const unsigned char*) "\x0d\xc1\x0c\x70\x01\xff\xff\xff\xff\x00\x3c\x10\x03", 13);
+    CHECK(d.calls == 1 && d.datapoint == 12 && d.value == -1 && d.rssi == 60);
+
+    d = decode_guarded((const unsigned char*) "\x08\xc3\x09\x03\x00\x70\x00\x00", 8);
+    CHECK(d.calls == 1 && d.success == 0 && d.error == MGW_STS_BUSY_MRF && d.seq_no == 7);
+
+    d = decode_guarded((const unsigned char*) "\x08\xc3\x1b\x00\x02\x08\x02\x05", 8);
+    CHECK(d.calls == 1 && d.version[0] == 2 && d.version[1] == 8 && d.version[2] == 2 && d.version[3] == 5);
+}
+
+// Frames from the stick decode to what they were made from
+
+static void
+check_round_trip()
+{
+    unsigned char frame[INTR_RECV_LENGTH];
+    decoded d;
+
+    for (int datapoint = 0; datapoint < 256; ++datapoint)
+    {
+	static const int values[] = { 0, 1, 99, 255, 256, 65535, -1, 0x7fffffff };
+
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+	{
+	    memset(frame, 0, sizeof(frame));
+	    xc_make_rx_msg((char*) frame, datapoint, MSG_STATUS, PERCENT, values[i], 70, MGW_RB_75, datapoint & 0xf);
+
+	    d = decode_guarded(frame, frame[0]);
+
+	    CHECK(d.calls == 1);
+	    CHECK(d.rx_event == MSG_STATUS);
+	    CHECK(d.datapoint == datapoint);
+	    CHECK(d.data_type == PERCENT);
+	    CHECK(d.value == values[i]);
+	    CHECK(d.rssi == 70);
+	    CHECK(d.battery == MGW_RB_75);
+	    CHECK(d.rx_seq_no == (datapoint & 0xf));
+	}
+    }
+
+    for (int seq_no = 0; seq_no < 16; ++seq_no)
+    {
+	memset(frame, 0, sizeof(frame));
+	xc_make_status_msg((char*) frame, MGW_STT_OK, 0, (seq_no << 4) | (0x5a << 8));
+
+	d = decode_guarded(frame, frame[0]);
+
+	CHECK(d.calls == 1);
+	CHECK(d.success == 1);
+	CHECK(d.seq_no == seq_no);
+	CHECK(d.extra == 0x5a);
+	CHECK(d.error == -1);
+
+	for (int error = MGW_STS_GENERAL; error <= MGW_STS_NO_ACK; ++error)
+	{
+	    memset(frame, 0, sizeof(frame));
+
+	    // NO_ACK has the sequence number where the others have extra data
+
+	    if (error == MGW_STS_NO_ACK)
+		xc_make_status_msg((char*) frame, MGW_STT_ERROR, error, seq_no << 4);
+	    else
+		xc_make_status_msg((char*) frame, MGW_STT_ERROR, error, 0x33 | (seq_no << 12));
+
+	    d = decode_guarded(frame, frame[0]);
+
+	    CHECK(d.calls == 1);
+	    CHECK(d.success == 0);
+	    CHECK(d.seq_no == seq_no);
+	    CHECK(d.error == error);
+	}
+    }
+
+    memset(frame, 0, sizeof(frame));
+    xc_make_status_msg((char*) frame, MGW_STT_RELEASE, 0, 2 | (8 << 8) | (2 << 16) | (5 << 24));
+
+    d = decode_guarded(frame, frame[0]);
+
+    CHECK(d.calls == 1);
+    CHECK(d.version[0] == 2 && d.version[1] == 8 && d.version[2] == 2 && d.version[3] == 5);
+}
+
+// Truncated frames are ignored, without reading past their end
+
+static void
+check_truncated()
+{
+    unsigned char frames[3][INTR_RECV_LENGTH];
+
+    memset(frames, 0, sizeof(frames));
+
+    xc_make_rx_msg((char*) frames[0], 1, MSG_STATUS, PERCENT, 1, 1, MGW_RB_NA, 1);
+    xc_make_status_msg((char*) frames[1], MGW_STT_OK, 0, 1 << 4);
+    xc_make_status_msg((char*) frames[2], MGW_STT_RELEASE, 0, 0);
+
+    for (int i = 0; i < 3; ++i)
+	for (size_t size = 0; size < frames[i][0]; ++size)
+	    CHECK(decode_guarded(frames[i], size).calls == 0);
+
+    // A message size that understates what the type needs
+
+    for (int i = 0; i < 3; ++i)
+    {
+	frames[i][0] = 2;
+
+	for (size_t size = 2; size < 8; ++size)
+	    CHECK(decode_guarded(frames[i], size).calls == 0);
+    }
+}
+
+static bool
+read_file(const char* path, std::vector<unsigned char>& contents)
+{
+    FILE* file = fopen(path, "rb");
+    unsigned char buffer[4096];
+    size_t got;
+
+    if (!file)
+	return false;
+
+    contents.clear();
+
+    while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	contents.insert(contents.end(), buffer, buffer + got);
+
+    fclose(file);
+
+    return true;
+}
+
+int
+main(int argc, char* argv[])
+{
+    // The decoder prints what it doesn't handle; keep it quiet
+
+    if (!freopen("/dev/null", "w", stdout))
+	return EXIT_FAILURE;
+
+    check_wire();
+    check_encoders();
+    check_golden();
+    check_round_trip();
+    check_truncated();
+
+    if (argc > 1)
+    {
+	// Reproduce inputs saved by a fuzzer
+
+	for (int i = 1; i < argc; ++i)
+	{
+	    std::vector<unsigned char> input;
+
+	    if (!read_file(argv[i], input))
+	    {
+		fprintf(stderr, "can't read %s\n", argv[i]);
+		return EXIT_FAILURE;
+	    }
+
+	    if (input.size() > guard.Size())
+		input.resize(guard.Size());
+
+	    decode_guarded(input.data(), input.size());
+	}
+    }
+    else
+    {
+	// Random frames, biased towards the known types
+
+	static const unsigned char types[] =
+	{
+	    MGW_PT_TX, MGW_PT_CONFIG, MGW_PT_RX, MGW_PT_STATUS, MGW_PT_FW
+	};
+
+	const char* iterations_env = getenv("FUZZ_ITERATIONS");
+	long iterations = iterations_env ? atol(iterations_env) : 1000000;
+	std::mt19937 random(1);
+	unsigned char input[64];
+
+	for (long i = 0; i < iterations; ++i)
+	{
+	    size_t size = random() % (sizeof(input) + 1);
+
+	    for (size_t j = 0; j < size; ++j)
+		input[j] = random();
+
+	    if (size > 1 && random() % 4)
+		input[1] = types[random() % sizeof(types)];
+
+	    if (size > 0 && random() % 2)
+		input[0] = random() % (size + 1);
+
+	    decode_guarded(input, size);
+	}
+    }
+
+    if (failures)
+    {
+	fprintf(stderr, "%d checks failed\n", failures);
+	return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "all checks passed\n");
+
+    return EXIT_SUCCESS;
+}
+
+#endif
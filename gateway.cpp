@@ -0,0 +1,1204 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <mosquitto.h>
+
+#include <sys/epoll.h>
+#include <syslog.h>
+#include <stdarg.h>
+#include <map>
+#include <string>
+
+#include "gateway.h"
+
+enum mqtt_topics
+{
+    MQTT_TOPIC_SWITCH,
+    MQTT_TOPIC_DIMMER,
+    MQTT_TOPIC_SHUTTER,
+    MQTT_TOPIC_REQUEST_STATUS,
+    MQTT_DEBUG
+};
+
+std::map<std::string, mqtt_topics> mqtt_topic_type = {
+    { "switch", MQTT_TOPIC_SWITCH },
+    { "dimmer", MQTT_TOPIC_DIMMER },
+    { "shutter", MQTT_TOPIC_SHUTTER },
+    { "requeststatus", MQTT_TOPIC_REQUEST_STATUS },
+    { "debug", MQTT_DEBUG }
+};
+
+std::map<std::string, mci_sb_command> shutter_cmd_type = {
+    { "down", MGW_TED_CLOSE },
+    { "up", MGW_TED_OPEN },
+    { "stop", MGW_TED_JSTOP }
+};
+
+XCtoMQTT::XCtoMQTT(bool verbose, bool use_syslog, int coalesce_window, int stats_interval)
+    : MQTTGateway(verbose),
+      change_buffer(NULL),
+      message_ids(5000),
+      messages_in_transit(0),
+      demoted_in_transit(0),
+      use_syslog(use_syslog),
+      coalesce_window(coalesce_window),
+      qos(1),
+      retain(true),
+      max_in_flight(1),
+      max_retries(5),
+      stats_server(stats),
+      stats_interval(stats_interval),
+      next_stats_time(-1),
+      last_wakeups(0),
+      last_stats_time(-1),
+      next_flush_time(0),
+      stick_answered(false),
+      dump_requested(false),
+      next_dump_time(0)
+{
+}
+
+bool
+XCtoMQTT::ServeStats(int port)
+{
+    if (!stats_server.Init(epoll_fd, port))
+    {
+	Error("failed to serve statistics on port %d: %s\n", port, strerror(errno));
+	return false;
+    }
+
+    return true;
+}
+
+void
+XCtoMQTT::Configure(const gateway_config& config)
+{
+    SetTopics(config.topic_prefix, config.subscribe_qos);
+
+    qos = config.qos;
+    retain = config.retain;
+    coalesce_window = config.coalesce_window;
+    max_in_flight = config.max_in_flight;
+    max_retries = config.retries;
+    devices = config.devices;
+
+    message_ids.SetQuarantineTime(config.quarantine);
+
+    health.SetInterval(config.health_interval * 1000);
+    watchdog.Configure(config.watchdog_failures, config.watchdog_silence * 1000);
+
+    if (stats_interval != config.stats_interval)
+    {
+	// Start over with the new interval
+
+	stats_interval = config.stats_interval;
+	next_stats_time = -1;
+    }
+}
+
+void
+XCtoMQTT::Stop()
+{
+    stats_server.Stop();
+
+    MQTTGateway::Stop();
+}
+
+void
+XCtoMQTT::Relno(int status,
+		unsigned int rf_major,
+		unsigned int rf_minor,
+		unsigned int usb_major,
+		unsigned int usb_minor)
+{
+    stick_answered = true;
+
+    if (status != 0x10)
+    {
+	release.known = true;
+	release.rf_major = rf_major;
+	release.rf_minor = rf_minor;
+	release.usb_major = usb_major;
+	release.usb_minor = usb_minor;
+
+	quirks = firmware_quirks_find(rf_major, rf_minor, usb_major, usb_minor);
+
+	if (quirks.description)
+	    Info("CKOZ-00/14 firmware RFV%d.%02d, USBV%d.%02d: %s\n",
+		 rf_major, rf_minor, usb_major, usb_minor, quirks.description);
+    }
+
+    if (verbose)
+    {
+        if (status == 0x10)
+	    Info("CKOZ-00/14 revision numbers: HW-Rev %d, RF-Rev %d, FW-Rev %d\n",
+	         rf_major,
+	         rf_minor,
+	         (usb_major << 8) + usb_minor);
+        else
+	    Info("CKOZ-00/14 version numbers: RFV%d.%02d, USBV%d.%02d\n",
+	         rf_major,
+	         rf_minor,
+	         usb_major,
+	         usb_minor);
+    }
+}
+
+void
+XCtoMQTT::PublishStatus(int datapoint,
+                        int value)
+{
+    // Received message that datapoint value changed
+
+    char topic[128];
+    char state[128];
+
+    if (!Connected() || outbox.HoldsState(datapoint))
+    {
+	// Only the latest state is published once we're back
+
+	outbox.State(datapoint, value);
+	return;
+    }
+
+    device_type type = DeviceType(datapoint);
+    const char* prefix = topic_prefix.c_str();
+    int rc = MOSQ_ERR_SUCCESS;
+
+    /* Unless the device table says what's behind the datapoint, the
+       state is published for every kind of device. */
+
+    if (type == DEVICE_UNKNOWN || type == DEVICE_DIMMER)
+    {
+	snprintf(topic, 128, "%s/%d/get/dimmer", prefix, datapoint);
+	snprintf(state, 128, "%d", value);
+
+	rc = PublishState(topic, state);
+    }
+
+    if (rc != MOSQ_ERR_NO_CONN && type != DEVICE_SHUTTER)
+    {
+	snprintf(topic, 128, "%s/%d/get/switch", prefix, datapoint);
+
+	rc = PublishState(topic, value ? "true" : "false");
+    }
+
+    if (rc != MOSQ_ERR_NO_CONN && (type == DEVICE_UNKNOWN || type == DEVICE_SHUTTER))
+    {
+	snprintf(topic, 128, "%s/%d/get/shutter", prefix, datapoint);
+
+	rc = PublishState(topic, xc_shutter_status_name(value));
+    }
+
+    if (rc == MOSQ_ERR_NO_CONN)
+	outbox.State(datapoint, value);
+}
+
+int
+XCtoMQTT::PublishState(const char* topic, const char* state)
+{
+    int rc = mosquitto_publish(mosq, NULL, topic, strlen(state), state, qos, retain);
+
+    if (rc && rc != MOSQ_ERR_NO_CONN)
+        Error("failed to publish message\n");
+
+    return rc;
+}
+
+void
+XCtoMQTT::PublishStats()
+{
+    std::string payload;
+
+    int64_t current_time = clock->Now();
+    uint64_t wakeups = stats.Wakeups();
+
+    if (last_stats_time != -1 && current_time > last_stats_time)
+	stats.SetWakeupRate((wakeups - last_wakeups) * 1000.0 / (current_time - last_stats_time));
+
+    last_wakeups = wakeups;
+    last_stats_time = current_time;
+
+    // Statistics are stale once the next ones are due
+
+    int64_t expires = current_time + stats_interval * 1000;
+
+    stats.FormatJSON(stats.Global(), payload);
+
+    std::string topic = topic_prefix + "/stats";
+
+    PublishEvent(topic.c_str(), payload.data(), payload.size(), 0, false, expires);
+
+    // What the stick reports about itself
+
+    payload.clear();
+    health.FormatJSON(payload);
+
+    topic = topic_prefix + "/stick/stats";
+    PublishEvent(topic.c_str(), payload.data(), payload.size(), 0, false, expires);
+
+    for (int datapoint = 0; datapoint < STATS_DATAPOINTS; ++datapoint)
+    {
+	const rf_stats* dp_stats = stats.Datapoint(datapoint);
+	char topic[128];
+
+	if (!dp_stats)
+	    continue;
+
+	snprintf(topic, 128, "%s/%d/stats", topic_prefix.c_str(), datapoint);
+
+	payload.clear();
+	stats.FormatJSON(*dp_stats, payload);
+
+	PublishEvent(topic, payload.data(), payload.size(), 0, false, expires);
+    }
+}
+
+void
+XCtoMQTT::PublishDump(int64_t current_time)
+{
+    std::string topic;
+    std::string payload;
+    int64_t expires = current_time + DUMP_EXPIRY;
+    int queued = 0;
+
+    // The queue, in the order the scheduler walks it
+
+    string_append(payload, "{\"in_flight\":%d,\"demoted_in_flight\":%d,\"max_in_flight\":%d,\"changes\":[",
+		  messages_in_transit, demoted_in_transit, InFlightLimit());
+
+    for (datapoint_change* dp = change_buffer; dp; dp = dp->next)
+    {
+	string_append(payload, "%s{\"datapoint\":%d,\"event\":\"%s\",\"value\":%d,\"sent_value\":%d,"
+		      "\"retries\":%d,\"age_ms\":%lld,\"active_id\":%d,\"due_ms\":%lld,\"demoted\":%s}",
+		      queued ? "," : "",
+		      dp->datapoint,
+		      xc_txevent_name(dp->event),
+		      dp->new_value,
+		      dp->sent_value,
+		      dp->retries,
+		      (long long) (current_time - dp->queued),
+		      dp->active_message_id,
+		      (long long) (dp->timeout > current_time ? dp->timeout - current_time : 0),
+		      datapoints[dp->datapoint].Demoted() ? "true" : "false");
+	queued++;
+    }
+
+    payload += "]}";
+
+    topic = topic_prefix + "/$sys/queue";
+    PublishEvent(topic.c_str(), payload.data(), payload.size(), 0, false, expires);
+
+    // Sequence numbers; the ones not listed are free
+
+    payload.clear();
+    string_append(payload, "{\"next\":%d,\"in_use\":[", message_ids.NextId());
+
+    const char* separator = "";
+
+    for (int id = 0; id < MESSAGE_ID_COUNT; ++id)
+	if (message_ids.Outstanding(id))
+	{
+	    string_append(payload, "%s%d", separator, id);
+	    separator = ",";
+	}
+
+    payload += "],\"quarantined_ms\":{";
+    separator = "";
+
+    for (int id = 0; id < MESSAGE_ID_COUNT; ++id)
+	if (message_ids.Quarantined(id, current_time))
+	{
+	    string_append(payload, "%s\"%d\":%lld", separator, id,
+			  (long long) (message_ids.FreeAt(id) - current_time));
+	    separator = ",";
+	}
+
+    payload += "}}";
+
+    topic = topic_prefix + "/$sys/ids";
+    PublishEvent(topic.c_str(), payload.data(), payload.size(), 0, false, expires);
+
+    // The stick
+
+    payload.clear();
+
+    if (release.known)
+	string_append(payload, "{\"rf\":\"%u.%02u\",\"usb\":\"%u.%02u\",",
+		      release.rf_major, release.rf_minor,
+		      release.usb_major, release.usb_minor);
+    else
+	payload += "{";
+
+    string_append(payload, "\"busy\":%s,\"health\":", CanSend() ? "false" : "true");
+    health.FormatJSON(payload);
+    payload += "}";
+
+    topic = topic_prefix + "/$sys/stick";
+    PublishEvent(topic.c_str(), payload.data(), payload.size(), 0, false, expires);
+
+    // Counters
+
+    payload.clear();
+    string_append(payload, "{\"queued\":%d,\"wakeups\":%llu,\"outbox_states\":%zu,\"outbox_events\":%zu,\"rf\":",
+		  queued,
+		  (unsigned long long) stats.Wakeups(),
+		  outbox.States(),
+		  outbox.Events());
+
+    stats.FormatJSON(stats.Global(), payload);
+    payload += "}";
+
+    topic = topic_prefix + "/$sys/counters";
+    PublishEvent(topic.c_str(), payload.data(), payload.size(), 0, false, expires);
+}
+
+void
+XCtoMQTT::PublishEvent(const char* topic,
+		       const void* payload,
+		       size_t length,
+		       int qos,
+		       bool retain,
+		       int64_t expires)
+{
+    // Events already waiting go first
+
+    if (Connected() && outbox.Empty())
+    {
+	int rc = mosquitto_publish(mosq, NULL, topic, length, payload, qos, retain);
+
+	if (rc != MOSQ_ERR_NO_CONN)
+	{
+	    if (rc)
+		Error("failed to publish message\n");
+
+	    return;
+	}
+    }
+
+    outbox.Event(topic, payload, length, qos, retain, expires);
+}
+
+void
+XCtoMQTT::FlushOutbox(int64_t current_time)
+{
+    int datapoint;
+    int value;
+    outbox_event event;
+
+    /* Latest states first, so subscribers catch up quickly, then the
+       events that are still of interest, in order.  A burst at a
+       time, to not swamp the broker. */
+
+    for (int i = 0; i < OUTBOX_BURST && Connected(); ++i)
+    {
+	if (outbox.NextState(datapoint, value))
+	    PublishStatus(datapoint, value);
+	else if (outbox.NextEvent(event, current_time))
+	{
+	    if (mosquitto_publish(mosq, NULL, event.topic.c_str(), event.payload.size(),
+				  event.payload.data(), event.qos, event.retain))
+		Error("failed to publish message\n");
+	}
+	else
+	    break;
+    }
+
+    next_flush_time = current_time + OUTBOX_PACE;
+}
+
+void
+XCtoMQTT::MessageReceived(mci_rx_event event,
+			  int datapoint,
+			  mci_rx_datatype data_type,
+			  int value,
+			  int rssi,
+			  mgw_rx_battery battery,
+			  int seq_no)
+{
+    if (verbose)
+	Info("received MGW_PT_RX(%s): datapoint: %d value_type: %d value: %d (signal: %s) (battery: %s) (seq no: %d)\n",
+             xc_rxevent_name(event),
+	     datapoint,
+	     data_type,
+	     value,
+             xc_rssi_status_name(rssi),
+             xc_battery_status_name(battery),
+             seq_no);
+
+    Responding(datapoint);
+
+    switch (event)
+    {
+    case MSG_STATUS:
+        {
+	    /* A dimmer reading as off can't be trusted on this firmware;
+	       the state from the last command it acked stands, rather
+	       than publishing it off and having it set back on. */
+
+	    if (value == 0 && (quirks.flags & QUIRK_DIMMER_STATUS_OFF) &&
+		DeviceType(datapoint) == DEVICE_DIMMER)
+	    {
+		if (verbose)
+		    Info("ignoring status from dimmer DP %d\n", datapoint);
+	    }
+	    else
+		PublishStatus(datapoint, value);
+
+	    for (datapoint_change* dp = change_buffer; dp; dp = dp->next)
+		if (dp->datapoint == datapoint)
+		{
+		    if (dp->event == MGW_TE_REQUEST)
+			// We're done
+
+			dp->retries = max_retries;
+
+		    break;
+		}
+	}
+	break;
+
+    default:
+	break;
+    }
+}
+
+void
+XCtoMQTT::AckReceived(int success, int seq_no, int extra, int error)
+{
+    int64_t current_time = clock->Now();
+
+    if (!message_ids.Outstanding(seq_no))
+    {
+	if (message_ids.Quarantined(seq_no, current_time))
+	{
+	    /* Messages can be acked after we have given up waiting
+	       for them.  The message has been resent with a different
+	       id, so there's nothing to do but to free up the id. */
+
+	    if (verbose)
+		Info("received late ack %d; message timeout is possibly too low\n", seq_no);
+
+	    message_ids.Release(seq_no);
+	}
+	else if (verbose)
+	    Info("received spurious ack %d\n", seq_no);
+
+	return;
+    }
+
+    message_ids.Release(seq_no);
+
+    for (datapoint_change* dp = change_buffer; dp; dp = dp->next)
+        if (dp->active_message_id == seq_no)
+        {
+            // We got an ack for this message; clear to send next
+            // messages, if any
+
+            dp->active_message_id = -1;
+            Released(dp);
+
+            if (verbose)
+            {
+                if (success)
+                    Info("Seq no %d acked after %d ms (extra %d)\n", seq_no, int(current_time - dp->last_sent), extra);
+                else
+                    Info("Seq no %d failed after %d ms, retrying\n", seq_no, int(current_time - dp->last_sent));
+            }
+
+            if (success)
+            {
+                datapoints[dp->datapoint].rtt.Sample(current_time - dp->last_sent);
+                Responding(dp->datapoint);
+
+                watchdog.Success();
+
+                stats.AckLatency(dp->datapoint, current_time - dp->last_sent);
+                stats.Completed(dp->datapoint, dp->retries, true);
+
+                if (dp->event != MGW_TE_REQUEST)
+                    PublishStatus(dp->datapoint, dp->sent_value);
+
+                if (dp->new_value == -1 && dp->event == MGW_TE_REQUEST)
+                    // Give the datapoint time to report its status
+                    // before asking again
+
+                    dp->timeout = current_time + RTO_MAX;
+                else
+                    // Send any updated value when the coalescing
+                    // window closes
+
+                    dp->timeout = dp->last_sent + coalesce_window;
+            }
+            else
+            {
+                stats.Failure(dp->datapoint, error);
+                health.Failure();
+
+                // Dead devices and bad values fail however well the
+                // stick works
+
+                if (error != MGW_STS_DP_OOR && !datapoints[dp->datapoint].Demoted())
+                    watchdog.Failure();
+
+                /* The busy errors are about the stick itself, and say
+                   nothing about whether the device is alive. */
+
+                RetryLater(dp, current_time,
+                           error != MGW_STS_BUSY_MRF &&
+                           error != MGW_STS_BUSY_MRF_RX &&
+                           error != MGW_STS_TX_MSG_LOST);
+            }
+
+            return;
+        }
+}
+
+void
+XCtoMQTT::StickLost()
+{
+    int64_t current_time = clock->Now();
+
+    /* Messages in flight went with the stick.  That's no fault of
+       the datapoints, so put them back in the queue as they were,
+       to be sent as soon as the stick is back. */
+
+    for (datapoint_change* dp = change_buffer; dp; dp = dp->next)
+	if (dp->active_message_id != -1)
+	{
+	    dp->active_message_id = -1;
+
+	    if (dp->new_value == -1)
+		dp->new_value = dp->sent_value;
+
+	    if (dp->retries > 0)
+		dp->retries--;
+
+	    dp->timeout = current_time;
+	}
+
+    // The stick forgets the ids in use when it's reset
+
+    message_ids.Reset();
+    messages_in_transit = 0;
+    demoted_in_transit = 0;
+
+    health.Restart(current_time);
+}
+
+void
+XCtoMQTT::ConfigReply(int type, unsigned int value)
+{
+    if (verbose && type == MGW_CT_SERIAL)
+	Info("CKOZ-00/14 serial number: %08x\n", value);
+
+    health.Reply(type, value, clock->Now());
+}
+
+int64_t
+XCtoMQTT::CheckHealth(int64_t current_time)
+{
+    int64_t waiting_since = WaitingSince();
+    const char* reason = NULL;
+
+    // Resets are spaced out by the watchdog, whatever the reason
+
+    if (watchdog.Expired(waiting_since, current_time))
+	reason = "the stick has stopped working";
+    else if (health.Wedged(current_time) && !watchdog.Holding(current_time))
+	reason = "the stick has stopped responding";
+
+    if (reason)
+    {
+	Error("%s\n", reason);
+
+	health.Restart(current_time);
+	watchdog.Reset(current_time);
+	ResetStick();
+
+	return current_time;
+    }
+
+    QueryHealth(current_time);
+
+    int64_t deadline = watchdog.NextDeadline(waiting_since);
+    int64_t health_deadline = health.Wedged(current_time) ? watchdog.NextReset() : health.NextDeadline();
+
+    return health_deadline < deadline ? health_deadline : deadline;
+}
+
+void
+XCtoMQTT::QueryHealth(int64_t current_time)
+{
+    int query = health.NextQuery(current_time);
+
+    if (query == -1 || !CanSend())
+	return;
+
+    if (!health.Overdue(current_time))
+    {
+	// Only in gaps; changes waiting to be sent go first
+
+	if (messages_in_transit)
+	    return;
+
+	for (datapoint_change* dp = change_buffer; dp; dp = dp->next)
+	    if (dp->active_message_id == -1 && dp->timeout <= current_time &&
+		(dp->new_value != -1 || dp->event == MGW_TE_REQUEST) && dp->retries < max_retries)
+		return;
+    }
+
+    char buffer[4];
+
+    xc_make_config_msg(buffer, query, 0);
+
+    if (Send(buffer, 4) == 0)
+	health.QuerySent(query, current_time);
+}
+
+device_type
+XCtoMQTT::DeviceType(int datapoint) const
+{
+    std::map<int, device_type>::const_iterator device = devices.find(datapoint);
+
+    return device == devices.end() ? DEVICE_UNKNOWN : device->second;
+}
+
+int
+XCtoMQTT::InFlightLimit() const
+{
+    if (quirks.max_in_flight && max_in_flight > quirks.max_in_flight)
+	return quirks.max_in_flight;
+
+    return max_in_flight;
+}
+
+void
+XCtoMQTT::Released(datapoint_change* dp)
+{
+    if (--messages_in_transit < 0)
+	messages_in_transit = 0;
+
+    if (dp->demoted && --demoted_in_transit < 0)
+	demoted_in_transit = 0;
+
+    dp->demoted = false;
+}
+
+void
+XCtoMQTT::Responding(int datapoint)
+{
+    std::map<int, datapoint_info>::iterator i = datapoints.find(datapoint);
+
+    if (i == datapoints.end())
+	return;
+
+    if (i->second.Demoted() && verbose)
+	Info("DP %d is responding again\n", datapoint);
+
+    i->second.failures = 0;
+}
+
+void
+XCtoMQTT::RetryLater(datapoint_change* dp, int64_t current_time, bool device_failed)
+{
+    datapoint_info& info = datapoints[dp->datapoint];
+
+    if (device_failed && ++info.failures == DEAD_DEVICE_FAILURES && verbose)
+	Info("DP %d is not responding; serving it at low priority\n", dp->datapoint);
+
+    if (dp->new_value == -1)
+	// Resend, unless the value was updated in the meantime
+
+	dp->new_value = dp->sent_value;
+
+    if (info.Demoted())
+	dp->timeout = current_time + info.RetryDelay();
+    else
+	dp->timeout = dp->last_sent + coalesce_window;
+}
+
+void
+XCtoMQTT::MessageLost(datapoint_change* dp, int64_t current_time)
+{
+    if (verbose)
+    {
+	if (dp->event == MGW_TE_REQUEST)
+	    Info("message %d was lost; status request from DP %d (retry %d)\n",
+		 dp->active_message_id, dp->datapoint, dp->retries);
+	else
+	    Info("message %d was lost; setting DP %d to %d (retry %d)\n",
+		 dp->active_message_id, dp->datapoint, dp->sent_value, dp->retries);
+    }
+
+    // An ack may still arrive for the old id
+
+    message_ids.Quarantine(dp->active_message_id, current_time);
+    dp->active_message_id = -1;
+    Released(dp);
+
+    stats.Failure(dp->datapoint, STATS_ERROR_TIMEOUT);
+    health.Failure();
+
+    if (!datapoints[dp->datapoint].Demoted())
+	watchdog.Failure();
+    datapoints[dp->datapoint].rtt.Backoff();
+
+    RetryLater(dp, current_time, true);
+}
+
+void
+XCtoMQTT::SendDPValue(int datapoint, int value, mci_tx_event event)
+{
+    datapoint_change* dp = change_buffer;
+
+    for (; dp; dp = dp->next)
+	if (dp->datapoint == datapoint)
+	    break;
+
+    if (dp)
+    {
+	// This datapoint has pending or active messages, update
+	// values in place and let the system handle it when it's
+	// ready
+
+	if (event != MGW_TE_REQUEST)
+	{
+	    // No need to do this for MGW_TE_REQUEST, status will be
+	    // reported implicitly or requested explicity if missing
+	    // anyways
+
+	    dp->new_value = value;
+	    dp->event = event;
+
+            if (dp->active_message_id == -1 && !datapoints[datapoint].Demoted())
+                // Values arriving within the coalescing window
+                // overwrite each other; only the last one is sent
+
+                dp->timeout = dp->last_sent + coalesce_window;
+	}
+    }
+    else
+    {
+	dp = new datapoint_change;
+
+	if (!dp)
+	    return;
+
+	dp->next = change_buffer;
+	dp->datapoint = datapoint;
+	dp->new_value = value;
+	dp->sent_value = -1;
+	dp->event = event;
+	dp->timeout = 0;
+	dp->last_sent = 0;
+	dp->queued = clock->Now();
+
+	dp->active_message_id = -1;
+	dp->demoted = false;
+
+	change_buffer = dp;
+    }
+
+    dp->retries = 0;
+}
+
+bool
+XCtoMQTT::SendChange(datapoint_change* dp, int64_t current_time)
+{
+    char buffer[9];
+    int message_id = message_ids.Allocate(current_time);
+    int value;
+
+    if (message_id == -1)
+	// All ids are awaiting acks; wait for one to free up
+
+	return false;
+
+    if (dp->new_value != -1)
+	value = dp->new_value;
+    else
+	value = dp->sent_value;
+
+    if (verbose)
+    {
+	if (dp->event == MGW_TE_REQUEST)
+	    Info("requesting status from DP %d (seq no %d, retry %d)\n",
+		 dp->datapoint, message_id, dp->retries);
+	else
+	    Info("setting DP %d to %d (seq no %d, retry %d)\n",
+		 dp->datapoint, value, message_id, dp->retries);
+    }
+
+    switch (dp->event)
+    {
+    case MGW_TE_SWITCH:
+	xc_make_switch_msg(buffer, dp->datapoint, value != 0, message_id);
+	break;
+
+    case MGW_TE_DIM:
+	xc_make_dim_msg(buffer, dp->datapoint, value, message_id);
+	break;
+
+    case MGW_TE_JALO:
+	xc_make_jalo_msg(buffer, dp->datapoint, (mci_sb_command) value, message_id);
+	break;
+
+    case MGW_TE_REQUEST:
+	xc_make_request_msg(buffer, dp->datapoint, message_id);
+	break;
+
+    default:
+	Error("Unsupported event\n");
+	message_ids.Release(message_id);
+	dp->retries = max_retries;
+	return false;
+    }
+
+    dp->retries++;
+    dp->active_message_id = message_id;
+    dp->new_value = -1;
+    dp->sent_value = value;
+    dp->last_sent = current_time;
+
+    // This is how long we'll wait until we consider the message to be lost
+    int timeout = datapoints[dp->datapoint].rtt.Timeout();
+
+    dp->demoted = datapoints[dp->datapoint].Demoted();
+    if (dp->demoted && timeout > DEAD_DEVICE_TIMEOUT)
+	timeout = DEAD_DEVICE_TIMEOUT;
+
+    dp->timeout = current_time + timeout;
+
+    Send(buffer, 9);
+
+    messages_in_transit++;
+
+    if (dp->demoted)
+	demoted_in_transit++;
+    health.Transmitted();
+
+    return true;
+}
+
+void
+XCtoMQTT::TrySendMore()
+{
+    int64_t current_time = clock->Now();
+
+    // Messages that weren't acked in time no longer occupy a slot
+
+    for (datapoint_change* dp = change_buffer; dp; dp = dp->next)
+	if (dp->active_message_id != -1 && dp->timeout <= current_time)
+	    MessageLost(dp, current_time);
+
+    if (!CanSend())
+	return;
+
+    /* Number of messages we can run in parallel; 1 by default.
+
+       The stick appears to run into issues when handling multiple
+       requests in parallel; it starts silently dropping messages
+       or throwing unknown errors.  If you are adventurous, you
+       can try bumping this for higher throughput when changing
+       multiple datapoints; I saw issues with 4+ parallel
+       requests. */
+
+    if (messages_in_transit >= InFlightLimit())
+	return;
+
+    /* Datapoints that keep failing are only served when no healthy
+       datapoints are waiting, and only so many at a time, so that a
+       dead device doesn't hold up everyone else. */
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+	if (pass == 1 && demoted_in_transit >= DEAD_DEVICE_IN_FLIGHT)
+	    continue;
+
+	datapoint_change* dp = change_buffer;
+	datapoint_change* prev = NULL;
+
+	while (dp)
+	{
+	    if (dp->timeout <= current_time &&
+		datapoints[dp->datapoint].Demoted() == (pass == 1))
+	    {
+		// Time to inspect this datapoint
+
+		if ((dp->new_value != -1 ||
+                     dp->event == MGW_TE_REQUEST) && dp->retries < max_retries)
+		{
+		    // Unsent; needs attention
+
+		    SendChange(dp, current_time);
+		    return;
+		}
+		else
+		{
+		    // Expired and not updated; delete entry
+
+		    datapoint_change* tmp = dp->next;
+
+		    if (dp->new_value != -1)
+			// Gave up on this change
+
+			stats.Completed(dp->datapoint, dp->retries, false);
+
+		    delete dp;
+
+		    if (prev)
+			dp = prev->next = tmp;
+		    else
+			dp = change_buffer = tmp;
+
+		    continue;
+		}
+	    }
+	    
+	    prev = dp;
+	    dp = dp->next;
+        }
+    }
+}
+
+void
+XCtoMQTT::MQTTMessage(const struct mosquitto_message* message)
+{
+    int value = 0;
+    char** topics;
+    int topic_count;
+
+    // Sent to a prefix that has since been changed
+
+    if (!UnderPrefix(message->topic))
+	return;
+
+    mosquitto_sub_topic_tokenise(message->topic, &topics, &topic_count);
+
+    // "<prefix>/<datapoint>/set/<type>"
+
+    if (topic_count != topic_levels + 3)
+    {
+	mosquitto_sub_topic_tokens_free(&topics, topic_count);
+	return;
+    }
+
+    // "<prefix>/$sys/set/dump" asks for introspection
+
+    if (strcmp(topics[topic_levels], "$sys") == 0)
+    {
+	if (strcmp(topics[topic_levels + 2], "dump") == 0)
+	    dump_requested = true;
+	else
+	    Error("Unknown topic\n");
+
+	mosquitto_sub_topic_tokens_free(&topics, topic_count);
+	return;
+    }
+
+    int datapoint = strtol(topics[topic_levels], NULL, 10);
+
+    if (errno == EINVAL || errno == ERANGE)
+        return;
+
+    switch (mqtt_topic_type[topics[topic_levels + 2]])
+    {
+    case MQTT_TOPIC_SWITCH:
+        if (strcmp((char*) message->payload, "true") == 0)
+            value = true;
+        else
+            value = false;
+
+        SendDPValue(datapoint, value, MGW_TE_SWITCH);
+        break;
+
+    case MQTT_TOPIC_DIMMER:
+        value = strtol((char*) message->payload, NULL, 10);
+
+        if (errno == EINVAL || errno == ERANGE)
+            return;
+
+        SendDPValue(datapoint, value, MGW_TE_DIM);
+        break;
+
+    case MQTT_TOPIC_SHUTTER:
+	SendDPValue(datapoint, shutter_cmd_type[(char*) message->payload], MGW_TE_JALO);
+        break;
+
+    case MQTT_TOPIC_REQUEST_STATUS:
+        SendDPValue(datapoint, -1, MGW_TE_REQUEST);
+        break;
+
+    case MQTT_DEBUG:
+        if (datapoint == 0)
+        {
+            if (strcmp((char*) message->payload, "true") == 0)
+                verbose = true;
+            else
+                verbose = false;
+        }
+        break;
+
+    default:
+	Error("Unknown topic\n");
+        break;
+    }
+
+    mosquitto_sub_topic_tokens_free(&topics, topic_count);
+}
+
+int
+XCtoMQTT::Prepoll(int epoll_fd)
+{
+    int next_change = INT_MAX;
+    int timeout = MQTTGateway::Prepoll(epoll_fd);
+    int64_t current_time = clock->Now();
+
+    // Called once per turn of the event loop
+
+    stats.Wakeup();
+    FlushCapture();
+
+    // Started once both the stick and the broker have answered
+
+    if (loop && stick_answered && Connected())
+	loop->Notifier().Ready();
+
+    if (stats_interval)
+    {
+	if (next_stats_time == -1)
+	{
+	    // First statistics one interval after starting
+
+	    next_stats_time = current_time + stats_interval * 1000;
+	    last_stats_time = current_time;
+	}
+
+	if (next_stats_time <= current_time)
+	{
+	    PublishStats();
+	    next_stats_time = current_time + stats_interval * 1000;
+	}
+
+	next_change = next_stats_time - current_time;
+    }
+
+    if (Connected() && !outbox.Empty())
+    {
+	if (next_flush_time <= current_time)
+	{
+	    unsigned dropped = outbox.TakeDropped();
+
+	    if (dropped)
+		Info("%u messages were dropped while the MQTT server was unreachable\n", dropped);
+
+	    FlushOutbox(current_time);
+	}
+
+	if (!outbox.Empty() && next_change > next_flush_time - current_time)
+	    next_change = next_flush_time - current_time;
+    }
+
+    if (change_buffer)
+    {
+	TrySendMore();
+
+	/* Find lowest timeout.  Entries that are already due are
+	   waiting for an ack to free up a slot, for the stick, or for a
+	   sequence number to come out of quarantine. */
+
+	bool waiting = false;
+
+	for (datapoint_change* dp = change_buffer; dp; dp = dp->next)
+	    if (dp->timeout > current_time)
+	    {
+		if (next_change > dp->timeout - current_time)
+		    next_change = dp->timeout - current_time;
+	    }
+	    else if (dp->active_message_id == -1)
+		waiting = true;
+
+	int64_t release = message_ids.NextRelease(current_time);
+
+	if (waiting && release != INT64_MAX && next_change > release - current_time)
+	    next_change = release - current_time;
+    }
+
+    int64_t stats_client_time = stats_server.Expire(current_time);
+
+    if (stats_client_time != INT64_MAX && next_change > stats_client_time - current_time)
+	next_change = stats_client_time - current_time;
+
+    int64_t health_time = CheckHealth(current_time);
+
+    if (health_time > current_time && next_change > health_time - current_time)
+	next_change = health_time - current_time;
+
+    if (dump_requested)
+    {
+	// Requests arriving together are answered by one dump
+
+	if (next_dump_time <= current_time)
+	{
+	    PublishDump(current_time);
+
+	    dump_requested = false;
+	    next_dump_time = current_time + DUMP_MIN_INTERVAL;
+	}
+	else if (next_change > next_dump_time - current_time)
+	    next_change = next_dump_time - current_time;
+    }
+
+    if (timeout < next_change)
+	return timeout;
+
+    return next_change;
+}
+
+void
+XCtoMQTT::Poll(const epoll_event& event)
+{
+    if (stats_server.Owns(event))
+	stats_server.Poll(event, clock->Now());
+    else
+	MQTTGateway::Poll(event);
+}
+
+void
+XCtoMQTT::Info(const char* fmt, ...)
+{
+    va_list argptr;
+    va_start(argptr, fmt);
+
+    if (use_syslog)
+	vsyslog(LOG_INFO, fmt, argptr);
+    else
+	vprintf(fmt, argptr);
+
+    va_end(argptr);
+}
+
+void
+XCtoMQTT::Error(const char* fmt, ...)
+{
+    va_list argptr;
+    va_start(argptr, fmt);
+
+    if (use_syslog)
+	vsyslog(LOG_ERR, fmt, argptr);
+    else
+	vfprintf(stderr, fmt, argptr);
+
+    va_end(argptr);
+}
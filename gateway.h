@@ -0,0 +1,315 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _XC_TO_MQTT_GATEWAY_H_
+#define _XC_TO_MQTT_GATEWAY_H_
+
+#include <map>
+
+#include "config.h"
+#include "health.h"
+#include "quirks.h"
+#include "watchdog.h"
+#include "mqtt.h"
+#include "msgid.h"
+#include "outbox.h"
+#include "rtt.h"
+#include "stats.h"
+
+struct datapoint_change
+{
+    // Linked list
+    datapoint_change* next;
+
+    // Datapoint this relates to
+    int datapoint;
+
+    int new_value;
+    int sent_value;
+
+    // number of retries
+    int retries;
+
+    // Event to be sent
+    mci_tx_event event;
+
+    // Non zero when we're waiting for an ack
+    int64_t timeout;
+
+    // The sequence number we're waiting for an ack for
+    int active_message_id;
+
+    // When the last message to this datapoint was sent
+    int64_t last_sent;
+
+    // When the change was first queued
+    int64_t queued;
+
+    // Sent in the slot for dead datapoints
+    bool demoted;
+};
+
+// Firmware versions reported by the stick
+
+struct stick_release
+{
+    stick_release() : known(false), rf_major(0), rf_minor(0), usb_major(0), usb_minor(0) {}
+
+    bool known;
+
+    unsigned int rf_major;
+    unsigned int rf_minor;
+    unsigned int usb_major;
+    unsigned int usb_minor;
+};
+
+/* While catching up after the broker was unreachable, this many
+   buffered messages are published every OUTBOX_PACE ms. */
+
+#define OUTBOX_BURST		32
+#define OUTBOX_PACE		50
+
+/* Datapoints that fail this many messages in a row are considered
+   dead.  They are only served when no other datapoints are waiting,
+   and with at most DEAD_DEVICE_IN_FLIGHT messages at a time, within
+   the usual in-flight limit.  Their messages are only waited for for
+   DEAD_DEVICE_TIMEOUT ms, so that a dead device holds up a change to
+   a healthy one for no longer than that. */
+
+#define DEAD_DEVICE_FAILURES	3
+#define DEAD_DEVICE_IN_FLIGHT	1
+#define DEAD_DEVICE_TIMEOUT	1000
+
+// Longest delay between retries to a dead datapoint, in ms
+
+#define DEAD_DEVICE_MAX_DELAY	60000
+
+/* Introspection dumps are published at most this often, in ms, and
+   are dropped if they can't be published within DUMP_EXPIRY ms. */
+
+#define DUMP_MIN_INTERVAL	1000
+#define DUMP_EXPIRY		10000
+
+// What we have learned about a datapoint, kept across changes
+
+struct datapoint_info
+{
+    datapoint_info() : failures(0) {}
+
+    bool Demoted() const { return failures >= DEAD_DEVICE_FAILURES; }
+
+    // Exponential backoff for dead datapoints
+
+    int RetryDelay() const
+    {
+	int shift = failures - DEAD_DEVICE_FAILURES;
+
+	if (shift > 6)
+	    return DEAD_DEVICE_MAX_DELAY;
+
+	return (1000 << shift) < DEAD_DEVICE_MAX_DELAY ? (1000 << shift) : DEAD_DEVICE_MAX_DELAY;
+    }
+
+    // Ack timeout estimation
+
+    RttEstimator rtt;
+
+    // Consecutive messages that failed or weren't acked
+
+    int failures;
+};
+
+class XCtoMQTT
+    : public MQTTGateway
+{
+public:
+
+    XCtoMQTT(bool verbose, bool use_syslog, int coalesce_window, int stats_interval);
+
+    // Serve statistics on the given local port
+
+    bool ServeStats(int port);
+
+    const Stats& Statistics() const { return stats; }
+
+    virtual void Stop();
+
+    int Prepoll(int epoll_fd);
+    virtual void Poll(const epoll_event& event);
+
+    void SendDPValue(int datapoint, int value, mci_tx_event event);
+
+    /* Apply new settings.  Called between events, so the scheduler
+       and the MQTT layer see either the old or the new settings;
+       queued changes are kept. */
+
+    void Configure(const gateway_config& config);
+
+    virtual void Error(const char* fmt, ...);
+    virtual void Info(const char* fmt, ...);
+
+protected:
+
+    void MQTTMessage(const struct mosquitto_message* message);
+
+    void PublishStatus(int datapoint,
+                       int value);
+
+private:
+
+    void TrySendMore();
+
+    bool SendChange(datapoint_change* dp, int64_t current_time);
+    void MessageLost(datapoint_change* dp, int64_t current_time);
+    void RetryLater(datapoint_change* dp, int64_t current_time, bool device_failed);
+    void Responding(int datapoint);
+
+    void PublishStats();
+
+    // Publish one state topic; returns the mosquitto error
+
+    int PublishState(const char* topic, const char* state);
+
+    // Publish, or keep for later if the broker is unreachable
+
+    void PublishEvent(const char* topic,
+		      const void* payload,
+		      size_t length,
+		      int qos,
+		      bool retain,
+		      int64_t expires);
+
+    void FlushOutbox(int64_t current_time);
+
+    /* Publish the scheduler state under "<prefix>/$sys/".  Built from
+       what's in memory in one pass, so it's cheap enough to do on the
+       event loop. */
+
+    void PublishDump(int64_t current_time);
+
+    // What the device table says is behind a datapoint
+
+    device_type DeviceType(int datapoint) const;
+
+    // Messages allowed in flight, with the firmware's limit applied
+
+    int InFlightLimit() const;
+
+    // A message no longer occupies a slot
+
+    void Released(datapoint_change* dp);
+
+    /* Query the stick about its health if it's idle, and reset it if
+       it looks wedged or the watchdog expires.  Returns when to be
+       called again. */
+
+    int64_t CheckHealth(int64_t current_time);
+
+    // Send the next health query, if the stick is idle or it's overdue
+
+    void QueryHealth(int64_t current_time);
+
+    virtual void Relno(int status,
+		       unsigned int rf_major,
+		       unsigned int rf_minor,
+		       unsigned int usb_major,
+		       unsigned int usb_minor);
+
+    virtual void MessageReceived(mci_rx_event event,
+				 int datapoint,
+				 mci_rx_datatype data_type,
+				 int value,
+				 int signal,
+				 mgw_rx_battery battery,
+				 int seq_no);
+
+    virtual void AckReceived(int success, int seq_no, int extra, int error);
+
+    virtual void ConfigReply(int type, unsigned int value);
+
+    virtual void StickLost();
+
+    /* Linked list that keeps track of requested datapoint changes.
+       This buffers requests, in order to prevent overloading the
+       stick. */
+
+    datapoint_change* change_buffer;
+
+    std::map<int, datapoint_info> datapoints;
+
+    // Sequence numbers in use
+
+    MessageIds message_ids;
+
+    // Messages in transit, and how many of them are to dead datapoints
+
+    int messages_in_transit;
+    int demoted_in_transit;
+
+    // Log to syslog
+
+    bool use_syslog;
+
+    /* Minimum time in ms between messages to the same datapoint.
+       Values arriving inside the window overwrite each other, so
+       only the latest one is transmitted when it closes. */
+
+    int coalesce_window;
+
+    // QoS and retain flag for published states
+
+    int qos;
+    bool retain;
+
+    // Messages awaiting an ack at the same time, and messages sent
+    // per change before giving up
+
+    int max_in_flight;
+    int max_retries;
+
+    // What's behind the datapoints, if known
+
+    std::map<int, device_type> devices;
+
+    // RF quality metrics
+
+    Stats stats;
+    StatsServer stats_server;
+
+    // Seconds between publishing statistics, 0 to disable
+
+    int stats_interval;
+    int64_t next_stats_time;
+
+    // Wakeups at the last statistics, for the rate
+
+    uint64_t last_wakeups;
+    int64_t last_stats_time;
+
+    // Messages waiting for the broker
+
+    Outbox outbox;
+    int64_t next_flush_time;
+
+    stick_release release;
+    firmware_quirks quirks;
+
+    // The stick has answered the release query, ie. it's up
+
+    bool stick_answered;
+
+    HealthMonitor health;
+    Watchdog watchdog;
+
+    // Introspection was asked for, and when it can next be published
+
+    bool dump_requested;
+    int64_t next_dump_time;
+};
+
+#endif
@@ -0,0 +1,231 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include "ckoz0014.h"
+#include "health.h"
+#include "stats.h"
+
+// A round of queries; the serial number only after a (re)connect
+
+static const int queries[] =
+{
+    MGW_CT_SERIAL,
+    MGW_CT_COUNTER_RX,
+    MGW_CT_COUNTER_TX,
+    MGW_CT_TIMEACCOUNT
+};
+
+#define QUERY_COUNT	int(sizeof(queries) / sizeof(queries[0]))
+
+HealthMonitor::HealthMonitor()
+    : interval(0),
+      position(-1),
+      next_round(0),
+      due_time(0),
+      outstanding(-1),
+      reply_deadline(0),
+      missed(0),
+      stuck(0),
+      have_rx(false),
+      have_tx(false),
+      last_rx(0),
+      last_tx(0),
+      rx_time(0),
+      tx_time(0),
+      rx_rate(0),
+      tx_rate(0),
+      tx_moved(false),
+      transmitted(0),
+      failures(0),
+      last_transmitted(0),
+      last_failures(0),
+      failure_delta(0),
+      time_account(-1),
+      have_serial(false),
+      serial(0)
+{
+}
+
+void
+HealthMonitor::Expire(int64_t current_time)
+{
+    if (outstanding != -1 && reply_deadline <= current_time)
+    {
+	missed++;
+	outstanding = -1;
+
+	Advance(current_time);
+    }
+}
+
+void
+HealthMonitor::Advance(int64_t current_time)
+{
+    if (++position >= QUERY_COUNT)
+    {
+	position = -1;
+	next_round = current_time + interval;
+    }
+    else
+	due_time = current_time;
+}
+
+int
+HealthMonitor::NextQuery(int64_t current_time)
+{
+    if (!interval)
+	return -1;
+
+    Expire(current_time);
+
+    if (outstanding != -1)
+	return -1;
+
+    if (position == -1)
+    {
+	if (next_round > current_time)
+	    return -1;
+
+	position = have_serial ? 1 : 0;
+	due_time = current_time;
+    }
+
+    return queries[position];
+}
+
+bool
+HealthMonitor::Overdue(int64_t current_time) const
+{
+    if (position == -1 || outstanding != -1)
+	return false;
+
+    // After a query went unanswered, there's no point in waiting
+
+    return missed || current_time - due_time >= HEALTH_MAX_WAIT;
+}
+
+void
+HealthMonitor::QuerySent(int type, int64_t current_time)
+{
+    outstanding = type;
+    reply_deadline = current_time + HEALTH_REPLY_TIMEOUT;
+}
+
+void
+HealthMonitor::Reply(int type, unsigned int value, int64_t current_time)
+{
+    // Anything from the stick shows it's alive
+
+    missed = 0;
+
+    switch (type)
+    {
+    case MGW_CT_COUNTER_RX:
+	if (have_rx && current_time > rx_time)
+	    rx_rate = uint32_t(value - last_rx) * 1000.0 / (current_time - rx_time);
+
+	have_rx = true;
+	last_rx = value;
+	rx_time = current_time;
+	break;
+
+    case MGW_CT_COUNTER_TX:
+	if (have_tx)
+	{
+	    if (current_time > tx_time)
+		tx_rate = uint32_t(value - last_tx) * 1000.0 / (current_time - tx_time);
+
+	    if (value != last_tx)
+	    {
+		tx_moved = true;
+		stuck = 0;
+	    }
+	    else if (tx_moved && transmitted - last_transmitted >= HEALTH_MIN_TRANSMITTED)
+		stuck++;
+	}
+
+	have_tx = true;
+	last_tx = value;
+	tx_time = current_time;
+
+	failure_delta = failures - last_failures;
+	last_failures = failures;
+	last_transmitted = transmitted;
+	break;
+
+    case MGW_CT_TIMEACCOUNT:
+	time_account = value;
+	break;
+
+    case MGW_CT_SERIAL:
+	have_serial = true;
+	serial = value;
+	break;
+    }
+
+    if (type == outstanding)
+    {
+	outstanding = -1;
+	Advance(current_time);
+    }
+}
+
+int64_t
+HealthMonitor::NextDeadline() const
+{
+    if (!interval)
+	return INT64_MAX;
+
+    if (outstanding != -1)
+	return reply_deadline;
+
+    if (position == -1)
+	return next_round;
+
+    // Due; waiting for the stick to be idle
+
+    return due_time + HEALTH_MAX_WAIT;
+}
+
+bool
+HealthMonitor::Wedged(int64_t current_time)
+{
+    Expire(current_time);
+
+    return missed >= HEALTH_MAX_MISSED || stuck >= HEALTH_MAX_STUCK;
+}
+
+void
+HealthMonitor::Restart(int64_t current_time)
+{
+    // The stick starts counting from zero again
+
+    position = -1;
+    next_round = current_time;
+    outstanding = -1;
+    missed = 0;
+    stuck = 0;
+    have_rx = have_tx = false;
+    tx_moved = false;
+    have_serial = false;
+}
+
+void
+HealthMonitor::FormatJSON(std::string& out) const
+{
+    string_append(out, "{\"rx_per_s\":%.2f,\"tx_per_s\":%.2f,\"failures\":%llu",
+		  rx_rate, tx_rate, (unsigned long long) failure_delta);
+
+    if (time_account != -1)
+	string_append(out, ",\"time_account\":%d", time_account);
+
+    if (have_serial)
+	string_append(out, ",\"serial\":\"%08x\"", serial);
+
+    out += "}";
+}
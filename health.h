@@ -0,0 +1,145 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _HEALTH_H_
+#define _HEALTH_H_
+
+#include <stdint.h>
+#include <string>
+
+// Time in ms to wait for the stick to answer a query
+
+#define HEALTH_REPLY_TIMEOUT	2000
+
+/* Time in ms a query waits for the stick to be idle; after that it's
+   sent as soon as the stick can take it, as a stick that never gets
+   idle may be one that has hung. */
+
+#define HEALTH_MAX_WAIT		5000
+
+// Queries in a row the stick doesn't answer before it's considered wedged
+
+#define HEALTH_MAX_MISSED	3
+
+/* Rounds in a row where we transmitted at least HEALTH_MIN_TRANSMITTED
+   frames, but the stick's transmit counter didn't move, before it's
+   considered wedged. */
+
+#define HEALTH_MIN_TRANSMITTED	3
+#define HEALTH_MAX_STUCK	2
+
+/* This class decides when to ask the stick about its health, and
+   makes sense of the answers.  A round of queries asks for the RF
+   frame counters and the time account, and the serial number after
+   the stick was (re)connected.  The counters are turned into rates;
+   a stick that stops answering, or stops transmitting while we keep
+   sending, is wedged. */
+
+class HealthMonitor
+{
+public:
+
+    HealthMonitor();
+
+    // Time in ms between rounds of queries; 0 stops them
+
+    void SetInterval(int interval) { this->interval = interval; }
+
+    // The query to send when the stick is idle, or -1 if none is due
+
+    int NextQuery(int64_t current_time);
+
+    /* True if the query due has waited too long for the stick to be
+       idle, or the last one wasn't answered */
+
+    bool Overdue(int64_t current_time) const;
+
+    void QuerySent(int type, int64_t current_time);
+    void Reply(int type, unsigned int value, int64_t current_time);
+
+    // We transmitted a frame to a device, and a frame failed
+
+    void Transmitted() { transmitted++; }
+    void Failure() { failures++; }
+
+    /* When a query is due or a reply is overdue, or INT64_MAX if
+       there's nothing to wait for.  A query may be due already, but
+       waiting for the stick to become idle. */
+
+    int64_t NextDeadline() const;
+
+    bool Wedged(int64_t current_time);
+
+    // The stick was reset or reconnected; start over
+
+    void Restart(int64_t current_time);
+
+    void FormatJSON(std::string& out) const;
+
+private:
+
+    // Give up waiting for a reply that's overdue
+
+    void Expire(int64_t current_time);
+
+    // Move on to the next query of the round
+
+    void Advance(int64_t current_time);
+
+    int interval;
+
+    // Query in the current round, -1 between rounds
+
+    int position;
+    int64_t next_round;
+
+    // When the current query became due
+
+    int64_t due_time;
+
+    // Query waiting for a reply, or -1
+
+    int outstanding;
+    int64_t reply_deadline;
+
+    int missed;
+    int stuck;
+
+    // Last counter readings, and rates derived from them
+
+    bool have_rx;
+    bool have_tx;
+    uint32_t last_rx;
+    uint32_t last_tx;
+    int64_t rx_time;
+    int64_t tx_time;
+    double rx_rate;
+    double tx_rate;
+
+    // Only trust the transmit counter once it's seen moving
+
+    bool tx_moved;
+
+    // Our own counts, and their values at the last transmit counter
+    // reading
+
+    uint64_t transmitted;
+    uint64_t failures;
+    uint64_t last_transmitted;
+    uint64_t last_failures;
+    uint64_t failure_delta;
+
+    // Percent, -1 if unknown
+
+    int time_account;
+
+    bool have_serial;
+    unsigned int serial;
+};
+
+#endif
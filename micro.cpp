@@ -0,0 +1,310 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+/*
+ *  Micro-benchmarks for the protocol codec and the per-message work
+ *  of the gateway.  Each case is run repeatedly for a fixed time, and
+ *  reports the time and the heap allocations per iteration.
+ *
+ *  The parser prints some frames to stdout; stdout is sent to
+ *  /dev/null while the benchmarks run, and the results go to the
+ *  original stdout.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <mosquitto.h>
+
+#include <vector>
+
+#include "gateway.h"
+
+/* Heap allocation counters.  All allocations, including the ones in
+   libmosquitto and operator new, go through malloc; these wrap the C
+   library's implementation (glibc specific). */
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void __libc_free(void* ptr);
+
+static uint64_t allocations;
+static uint64_t allocated_bytes;
+
+extern "C" void*
+malloc(size_t size)
+{
+    allocations++;
+    allocated_bytes += size;
+
+    return __libc_malloc(size);
+}
+
+extern "C" void*
+calloc(size_t count, size_t size)
+{
+    allocations++;
+    allocated_bytes += count * size;
+
+    return __libc_calloc(count, size);
+}
+
+extern "C" void*
+realloc(void* ptr, size_t size)
+{
+    allocations++;
+    allocated_bytes += size;
+
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void
+free(void* ptr)
+{
+    __libc_free(ptr);
+}
+
+static int64_t
+now_ns()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (int64_t(tp.tv_sec) * 1000000000) + tp.tv_nsec;
+}
+
+// Keeps the compiler from optimizing the work away
+
+static volatile int sink;
+
+static void
+recv_fn(void* user_data, mci_rx_event event, int datapoint, mci_rx_datatype data_type,
+	int value, int signal, mgw_rx_battery battery, int seq_no)
+{
+    sink = datapoint + value;
+}
+
+static void
+ack_fn(void* user_data, int success, int seq_no, int extra, int error)
+{
+    sink = seq_no + extra;
+}
+
+static void
+info_fn(void* user_data, int type, unsigned int value)
+{
+    sink = type + value;
+}
+
+static void
+relno_fn(void* user_data, int status, unsigned int rf_major, unsigned int rf_minor,
+	 unsigned int usb_major, unsigned int usb_minor)
+{
+    sink = rf_major + usb_major;
+}
+
+/* The gateway, without a broker connection.  PublishStatus keeps the
+   state for when the broker is back, so that's what is measured. */
+
+class MicroGateway
+    : public XCtoMQTT
+{
+public:
+
+    MicroGateway()
+	: XCtoMQTT(false, false, 0, 0)
+    {
+    }
+
+    using XCtoMQTT::MQTTMessage;
+    using XCtoMQTT::PublishStatus;
+
+protected:
+
+    virtual void Error(const char* fmt, ...) {}
+    virtual void Info(const char* fmt, ...) {}
+};
+
+struct result
+{
+    const char* name;
+    double ns;
+    double allocations;
+    double bytes;
+};
+
+static std::vector<result> results;
+
+// Minimum time each case runs for
+
+static int64_t run_time = 200000000;
+
+template <typename F>
+static void
+run(const char* name, F body)
+{
+    uint64_t iterations = 0;
+    uint64_t batch = 64;
+
+    // Warm up, so caches and lazily allocated state are in place
+
+    for (int i = 0; i < 1000; ++i)
+	body();
+
+    uint64_t allocations_start = allocations;
+    uint64_t bytes_start = allocated_bytes;
+    int64_t start = now_ns();
+    int64_t elapsed;
+
+    do
+    {
+	for (uint64_t i = 0; i < batch; ++i)
+	    body();
+
+	iterations += batch;
+	elapsed = now_ns() - start;
+
+	if (batch < 65536)
+	    batch *= 2;
+    }
+    while (elapsed < run_time);
+
+    result r;
+
+    r.name = name;
+    r.ns = double(elapsed) / iterations;
+    r.allocations = double(allocations - allocations_start) / iterations;
+    r.bytes = double(allocated_bytes - bytes_start) / iterations;
+
+    results.push_back(r);
+}
+
+static void
+frame(unsigned char* buffer, const char* init)
+{
+    memset(buffer, 0, INTR_RECV_LENGTH);
+    memcpy(buffer, init, init[0]);
+}
+
+int
+main(int argc, char* argv[])
+{
+    xc_parse_data data;
+    char out[INTR_SEND_LENGTH];
+
+    if (argc > 1)
+	run_time = atoi(argv[1]) * int64_t(1000000);
+
+    data.recv = recv_fn;
+    data.ack = ack_fn;
+    data.relno = relno_fn;
+    data.info = info_fn;
+    data.user_data = NULL;
+
+    // Results go to the original stdout
+
+    FILE* report = fdopen(dup(STDOUT_FILENO), "w");
+
+    if (!report || !freopen("/dev/null", "w", stdout))
+	return 1;
+
+    // Decoder, one case per frame type the stick sends
+
+    unsigned char rx[INTR_RECV_LENGTH];
+    unsigned char ok[INTR_RECV_LENGTH];
+    unsigned char error[INTR_RECV_LENGTH];
+    unsigned char release[INTR_RECV_LENGTH];
+    unsigned char counter[INTR_RECV_LENGTH];
+    unsigned char fw[INTR_RECV_LENGTH];
+    unsigned char tx[INTR_RECV_LENGTH];
+    unsigned char config[INTR_RECV_LENGTH];
+
+    memset(rx, 0, sizeof(rx));
+    xc_make_rx_msg((char*) rx, 12, MSG_STATUS, PERCENT, 55, 60, MGW_RB_PWR, 3);
+
+    memset(ok, 0, sizeof(ok));
+    xc_make_status_msg((char*) ok, MGW_STT_OK, 0, 7 << 4);
+
+    memset(error, 0, sizeof(error));
+    xc_make_status_msg((char*) error, MGW_STT_ERROR, MGW_STS_BUSY_MRF, 7 << 12);
+
+    memset(release, 0, sizeof(release));
+    xc_make_status_msg((char*) release, MGW_STT_RELEASE, 0, 2 | (10 << 8) | (2 << 16) | (5 << 24));
+
+    memset(counter, 0, sizeof(counter));
+    xc_make_status_msg((char*) counter, MGW_CT_COUNTER_RX, 0, 1234);
+
+    frame(fw, "\x0e\xd1\x00\x00\x00\x00\x00\x00\x00\x00\x00\x02\x05\x00");
+
+    memset(tx, 0, sizeof(tx));
+    xc_make_dim_msg((char*) tx, 12, 55, 3);
+
+    memset(config, 0, sizeof(config));
+    xc_make_config_msg((char*) config, MGW_CT_RELEASE, 0);
+
+    run("parse MGW_PT_RX", [&] { xc_parse_packet(rx, sizeof(rx), &data); });
+    run("parse MGW_PT_STATUS ok", [&] { xc_parse_packet(ok, sizeof(ok), &data); });
+    run("parse MGW_PT_STATUS error", [&] { xc_parse_packet(error, sizeof(error), &data); });
+    run("parse MGW_PT_STATUS release", [&] { xc_parse_packet(release, sizeof(release), &data); });
+    run("parse MGW_PT_STATUS counter", [&] { xc_parse_packet(counter, sizeof(counter), &data); });
+    run("parse MGW_PT_FW", [&] { xc_parse_packet(fw, sizeof(fw), &data); });
+    run("parse MGW_PT_TX", [&] { xc_parse_packet(tx, sizeof(tx), &data); });
+    run("parse MGW_PT_CONFIG", [&] { xc_parse_packet(config, sizeof(config), &data); });
+
+    // Encoders
+
+    int seq_no = 0;
+
+    run("make switch", [&] { seq_no++; xc_make_switch_msg(out, 12, seq_no & 1, seq_no & 0xf); sink = out[8]; });
+    run("make dim", [&] { seq_no++; xc_make_dim_msg(out, 12, seq_no % 100, seq_no & 0xf); sink = out[8]; });
+    run("make jalo", [&] { seq_no++; xc_make_jalo_msg(out, 12, MGW_TED_OPEN, seq_no & 0xf); sink = out[8]; });
+    run("make request", [&] { seq_no++; xc_make_request_msg(out, 12, seq_no & 0xf); sink = out[8]; });
+    run("make config", [&] { xc_make_config_msg(out, MGW_CT_RELEASE, 0); sink = out[2]; });
+
+    // The gateway's work per message
+
+    MicroGateway gateway;
+    mosquitto_message message;
+    char topic[32] = "xcomfort/12/set/dimmer";
+    char payload[8] = "55";
+
+    memset(&message, 0, sizeof(message));
+    message.topic = topic;
+    message.payload = payload;
+    message.payloadlen = 2;
+
+    run("MQTTMessage dimmer", [&] { gateway.MQTTMessage(&message); });
+
+    strcpy(topic, "xcomfort/12/set/switch");
+    strcpy(payload, "true");
+    message.payloadlen = 4;
+
+    run("MQTTMessage switch", [&] { gateway.MQTTMessage(&message); });
+
+    run("PublishStatus", [&] { gateway.PublishStatus(12, 55); });
+
+    // A status message from a device, from frame to publish
+
+    TransportListener& listener = gateway;
+
+    run("frame to PublishStatus", [&] { listener.FrameReceived(rx, sizeof(rx)); });
+
+    fprintf(report, "%-32s %12s %12s %12s\n", "benchmark", "ns/op", "allocs/op", "bytes/op");
+
+    for (size_t i = 0; i < results.size(); ++i)
+	fprintf(report, "%-32s %12.1f %12.2f %12.1f\n",
+		results[i].name, results[i].ns, results[i].allocations, results[i].bytes);
+
+    fclose(report);
+
+    return 0;
+}
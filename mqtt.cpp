@@ -8,25 +8,31 @@
 
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <mosquitto.h>
 #include <poll.h>
+#include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "mqtt.h"
 
-int64_t getmseconds()
-{
-    struct timespec tp;
-
-    clock_gettime(CLOCK_MONOTONIC_COARSE, &tp);
-    return (int64_t(tp.tv_sec) * 1000) + (tp.tv_nsec / 1000000);
-}
-
 MQTTGateway::MQTTGateway(bool verbose)
     : verbose(verbose),
       mosq(NULL),
-      reconnect_time(INT64_MAX)
+      topic_prefix("xcomfort"),
+      topic_levels(1),
+      subscribe_qos(0),
+      socket_fd(-1),
+      connected(false),
+      reconnect_time(INT64_MAX),
+      connect_deadline(INT64_MAX),
+      reconnect_delay(MQTT_RECONNECT_MIN),
+      misc_time(0),
+      threaded(false),
+      event_fd(-1)
 {
 }
 
@@ -35,7 +41,10 @@ MQTTGateway::mqtt_connected(mosquitto* mosq, void* obj, int rc)
 {
     MQTTGateway* this_object = (MQTTGateway*) obj;
 
-    this_object->MQTTConnected(rc);
+    if (this_object->threaded)
+	this_object->Hand(MQTT_EVENT_CONNECTED, rc, NULL);
+    else
+	this_object->MQTTConnected(rc);
 }
 
 void
@@ -44,7 +53,58 @@ MQTTGateway::MQTTConnected(int rc)
     if (verbose)
 	Info("MQTT Connected, %s\n", mosquitto_connack_string(rc));
 
-    mosquitto_subscribe(mosq, NULL, "xcomfort/+/set/+", 0);
+    connect_deadline = INT64_MAX;
+
+    if (rc)
+	// Refused; the broker closes the connection
+
+	return;
+
+    connected = true;
+    reconnect_delay = MQTT_RECONNECT_MIN;
+
+    Subscribe();
+}
+
+void
+MQTTGateway::Subscribe()
+{
+    std::string topic = topic_prefix + "/+/set/+";
+
+    mosquitto_subscribe(mosq, NULL, topic.c_str(), subscribe_qos);
+}
+
+void
+MQTTGateway::SetTopics(const std::string& prefix, int qos)
+{
+    if (prefix == topic_prefix && qos == subscribe_qos)
+	return;
+
+    if (connected)
+    {
+	std::string topic = topic_prefix + "/+/set/+";
+
+	mosquitto_unsubscribe(mosq, NULL, topic.c_str());
+    }
+
+    topic_prefix = prefix;
+    subscribe_qos = qos;
+    topic_levels = 1;
+
+    for (size_t i = 0; i < prefix.size(); ++i)
+	if (prefix[i] == '/')
+	    topic_levels++;
+
+    if (connected)
+	Subscribe();
+}
+
+bool
+MQTTGateway::UnderPrefix(const char* topic) const
+{
+    size_t length = topic_prefix.size();
+
+    return strncmp(topic, topic_prefix.c_str(), length) == 0 && topic[length] == '/';
 }
 
 void
@@ -52,7 +112,10 @@ MQTTGateway::mqtt_disconnected(mosquitto* mosq, void* obj, int rc)
 {
     MQTTGateway* this_object = (MQTTGateway*) obj;
 
-    this_object->MQTTDisconnected(rc);
+    if (this_object->threaded)
+	this_object->Hand(MQTT_EVENT_DISCONNECTED, rc, NULL);
+    else
+	this_object->MQTTDisconnected(rc);
 }
 
 void
@@ -61,9 +124,58 @@ MQTTGateway::MQTTDisconnected(int rc)
     if (verbose)
 	Info("MQTT Disconnected, %s\n", mosquitto_strerror(rc));
 
-    // Attempt to reconnect in 15 seconds
+    if (threaded)
+	// libmosquitto reconnects by itself
 
-    reconnect_time = getmseconds() + 15000;
+	connected = false;
+    else
+	ScheduleReconnect();
+}
+
+void
+MQTTGateway::ScheduleReconnect()
+{
+    if (reconnect_time != INT64_MAX)
+	return;
+
+    connected = false;
+    connect_deadline = INT64_MAX;
+
+    /* Spread the attempts out between half and all of the current
+       delay, so that many clients don't retry in lockstep. */
+
+    int delay = reconnect_delay / 2 + std::uniform_int_distribution<int>(0, reconnect_delay / 2)(random);
+
+    reconnect_time = clock->Now() + delay;
+
+    if (reconnect_delay < MQTT_RECONNECT_MAX / 2)
+	reconnect_delay *= 2;
+    else
+	reconnect_delay = MQTT_RECONNECT_MAX;
+
+    if (verbose)
+	Info("MQTT, reconnecting in %d ms\n", delay);
+}
+
+void
+MQTTGateway::Connect()
+{
+    reconnect_time = INT64_MAX;
+
+    // Doesn't wait for the broker; the outcome is reported through
+    // the socket
+
+    int rc = mosquitto_reconnect_async(mosq);
+
+    if (rc)
+    {
+	Info("MQTT, Reconnecting failed, %s\n", mosquitto_strerror(rc));
+	ScheduleReconnect();
+    }
+    else
+	connect_deadline = clock->Now() + MQTT_CONNECT_TIMEOUT;
+
+    UpdateSocket();
 }
 
 void
@@ -71,7 +183,66 @@ MQTTGateway::mqtt_message(mosquitto* mosq, void* obj, const struct mosquitto_mes
 {
     MQTTGateway* this_object = (MQTTGateway*) obj;
 
-    this_object->MQTTMessage(message);
+    if (this_object->threaded)
+	this_object->Hand(MQTT_EVENT_MESSAGE, 0, message);
+    else
+	this_object->MQTTMessage(message);
+}
+
+void
+MQTTGateway::Hand(mqtt_event_type type, int rc, const struct mosquitto_message* message)
+{
+    mqtt_event event;
+    uint64_t one = 1;
+
+    event.type = type;
+    event.rc = rc;
+    event.message = NULL;
+
+    if (message)
+    {
+	// The message is only valid for the duration of the callback
+
+	event.message = (mosquitto_message*) calloc(1, sizeof(mosquitto_message));
+
+	if (!event.message || mosquitto_message_copy(event.message, message))
+	{
+	    mosquitto_message_free(&event.message);
+	    return;
+	}
+    }
+
+    events.Push(event);
+
+    if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	Error("write failed %s\n", strerror(errno));
+}
+
+void
+MQTTGateway::HandleEvents()
+{
+    mqtt_event event;
+    uint64_t count;
+
+    if (read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+	Error("read failed %s\n", strerror(errno));
+
+    while (events.Pop(event))
+	switch (event.type)
+	{
+	case MQTT_EVENT_CONNECTED:
+	    MQTTConnected(event.rc);
+	    break;
+
+	case MQTT_EVENT_DISCONNECTED:
+	    MQTTDisconnected(event.rc);
+	    break;
+
+	case MQTT_EVENT_MESSAGE:
+	    MQTTMessage(event.message);
+	    mosquitto_message_free(&event.message);
+	    break;
+	}
 }
 
 bool
@@ -80,6 +251,11 @@ MQTTGateway::Init(int epoll_fd, const char* server, int port, const char* userna
     char clientid[24];
     int err = 0;
 
+    // The stick is served whether or not the broker is reachable
+
+    if (!USB::Init(epoll_fd))
+	return false;
+
     mosquitto_lib_init();
 
     memset(clientid, 0, 24);
@@ -96,35 +272,109 @@ MQTTGateway::Init(int epoll_fd, const char* server, int port, const char* userna
     if (username && password)
 	mosquitto_username_pw_set(mosq, username, password);
 
-    err = mosquitto_connect(mosq, server, port, 30);
+    random.seed(clock->Now() ^ getpid());
 
-    if (err)
+    if (threaded)
+    {
+	epoll_event wakeup;
+
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	memset(&wakeup, 0, sizeof(wakeup));
+	wakeup.events = EPOLLIN;
+	wakeup.data.ptr = this;
+
+	if (event_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &wakeup) < 0)
+	{
+	    Error("failed to set up MQTT thread: %s\n", strerror(errno));
+	    return false;
+	}
+
+	mosquitto_reconnect_delay_set(mosq, MQTT_RECONNECT_MIN / 1000, MQTT_RECONNECT_MAX / 1000, true);
+
+	// Failures to connect are retried on the thread
+
+	err = mosquitto_connect_async(mosq, server, port, MQTT_KEEPALIVE);
+
+	if (err == MOSQ_ERR_INVAL)
+	{
+	    Error("failed to connect to MQTT server: %s\n", mosquitto_strerror(err));
+	    return false;
+	}
+	else if (err)
+	    Error("failed to connect to MQTT server: %s\n", mosquitto_strerror(err));
+
+	err = mosquitto_loop_start(mosq);
+
+	if (err)
+	{
+	    Error("failed to start MQTT thread: %s\n", mosquitto_strerror(err));
+	    return false;
+	}
+
+	return true;
+    }
+
+    err = mosquitto_connect_async(mosq, server, port, MQTT_KEEPALIVE);
+
+    if (err == MOSQ_ERR_INVAL)
     {
 	Error("failed to connect to MQTT server: %s\n", mosquitto_strerror(err));
 	return false;
     }
 
-    if (!USB::Init(epoll_fd))
-	return false;
+    if (err)
+    {
+	// The address is kept, so later attempts can be made with
+	// mosquitto_reconnect_async()
+
+	Error("failed to connect to MQTT server: %s\n", mosquitto_strerror(err));
+	ScheduleReconnect();
+    }
+    else
+	connect_deadline = clock->Now() + MQTT_CONNECT_TIMEOUT;
 
-    return RegisterSocket();
+    UpdateSocket();
+
+    return true;
 }
 
-bool
-MQTTGateway::RegisterSocket()
+void
+MQTTGateway::UpdateSocket()
 {
     epoll_event mosquitto_event;
 
-    mosquitto_event.events = EPOLLIN;
+    // A socket left behind by a failed connection isn't polled while
+    // waiting to reconnect
+
+    int fd = reconnect_time == INT64_MAX ? mosquitto_socket(mosq) : -1;
+
+    if (fd != socket_fd && socket_fd != -1)
+	// Fails if mosquitto already closed it, which is fine
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, socket_fd, NULL);
+
+    socket_fd = fd;
+
+    if (fd == -1)
+	return;
+
+    memset(&mosquitto_event, 0, sizeof(mosquitto_event));
     mosquitto_event.data.ptr = this;
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mosquitto_socket(mosq), &mosquitto_event) < 0)
-    {
-	Error("epoll_ctl failed %s\n", strerror(errno));
-        return false;
-    }
+    // Mosquitto isn't making this easy
 
-    return true;
+    if (mosquitto_want_write(mosq))
+	mosquitto_event.events = EPOLLIN|EPOLLOUT;
+    else
+	mosquitto_event.events = EPOLLIN;
+
+    /* A new socket may reuse the number of the old one, which was
+       dropped from epoll when it was closed. */
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &mosquitto_event) < 0 &&
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &mosquitto_event) < 0)
+	Error("epoll_ctl failed %s\n", strerror(errno));
 }
 
 void
@@ -134,77 +384,103 @@ MQTTGateway::Stop()
 
     if (mosq)
     {
-	mosquitto_disconnect(mosq);
+	if (connected)
+	    mosquitto_disconnect(mosq);
+
+	if (threaded)
+	{
+	    mqtt_event event;
+
+	    mosquitto_loop_stop(mosq, !connected);
+
+	    while (events.Pop(event))
+		mosquitto_message_free(&event.message);
+	}
+
 	mosquitto_destroy(mosq);
 
         mosq = NULL;
     }
 
+    if (event_fd != -1)
+    {
+	close(event_fd);
+	event_fd = -1;
+    }
+
     mosquitto_lib_cleanup();
 }
 
 int
 MQTTGateway::Prepoll(int epoll_fd)
 {
-    epoll_event mosquitto_event;
-
-    mosquitto_event.data.ptr = this;
+    int64_t current_time = clock->Now();
 
-    if (reconnect_time < getmseconds())
-    {
-	int rc = mosquitto_reconnect(mosq);
-
-	if (rc)
-	{
-	    Info("MQTT, Reconnecting failed, %s\n", mosquitto_strerror(rc));
+    if (threaded)
+	// Nothing to do until the thread hands us something
 
-	    // Attempt to reconnect in 15 seconds
+	return INT_MAX;
 
-	    reconnect_time = getmseconds() + 15000;
-	}
-	else
-	{
-	    RegisterSocket();
-	    reconnect_time = INT64_MAX;
-	}
+    if (reconnect_time <= current_time)
+	Connect();
+    else if (connect_deadline <= current_time)
+    {
+	Info("MQTT, no answer from the broker\n");
+	ScheduleReconnect();
     }
 
-    if (mosquitto_socket(mosq) != -1)
+    if (misc_time <= current_time)
     {
-	// Mosquitto isn't making this easy
+	// Sends keepalive pings, and notices a broker gone quiet
 
-	if (mosquitto_want_write(mosq))
-	{
-	    mosquitto_event.events = EPOLLIN|EPOLLOUT;
-	    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, mosquitto_socket(mosq), &mosquitto_event);
-	}
-	else
-	{
-	    mosquitto_event.events = EPOLLIN;
-	    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, mosquitto_socket(mosq), &mosquitto_event);
-	}
+	mosquitto_loop_misc(mosq);
+	misc_time = current_time + MQTT_MISC_INTERVAL;
     }
 
-    // Should be called "fairly frequently"
+    UpdateSocket();
+
+    // Sleep until the next thing we have to do
+
+    int64_t deadline = misc_time;
 
-    mosquitto_loop_misc(mosq);
+    if (deadline > reconnect_time)
+	deadline = reconnect_time;
+    if (deadline > connect_deadline)
+	deadline = connect_deadline;
 
-    // 500ms minimum timeout, for the above call
+    if (deadline <= current_time)
+	return 0;
 
-    return 500;
+    return deadline - current_time < INT_MAX ? deadline - current_time : INT_MAX;
 }
 
 void
 MQTTGateway::Poll(const epoll_event& event)
 {
-    if (event.data.ptr == this)
+    if (event.data.ptr == this && threaded)
+	HandleEvents();
+    else if (event.data.ptr == this)
     {
 	// This is for mosquitto
 
-	if (event.events & POLLIN)
-	    mosquitto_loop_read(mosq, 1);
-	if (event.events & POLLOUT)
-	    mosquitto_loop_write(mosq, 1);
+	int rc = MOSQ_ERR_SUCCESS;
+
+	if (event.events & (POLLIN|POLLERR|POLLHUP))
+	    rc = mosquitto_loop_read(mosq, 1);
+	if (rc == MOSQ_ERR_SUCCESS && (event.events & POLLOUT))
+	    rc = mosquitto_loop_write(mosq, 1);
+
+	// A connection attempt that failed, or a lost connection
+
+	if (rc != MOSQ_ERR_SUCCESS)
+	{
+	    if (verbose)
+		Info("MQTT connection failed, %s\n", mosquitto_strerror(rc));
+
+	    ScheduleReconnect();
+	}
+
+	UpdateSocket();
     }
     else
 	USB::Poll(event);
@@ -9,9 +9,45 @@
 #ifndef _MQTT_GATEWAY_H_
 #define _MQTT_GATEWAY_H_
 
+#include <random>
+#include <string>
+
+#include "queue.h"
 #include "usb.h"
 
-int64_t getmseconds();
+// Delay before reconnecting to the broker, doubled on every failure
+
+#define MQTT_RECONNECT_MIN	1000
+#define MQTT_RECONNECT_MAX	60000
+
+// Give up on a connection attempt that gets no CONNACK in this time
+
+#define MQTT_CONNECT_TIMEOUT	30000
+
+// Keepalive in seconds, as told to the broker
+
+#define MQTT_KEEPALIVE		30
+
+/* How often mosquitto_loop_misc() is called, for the keepalive
+   pings; a ping is at most this late, which brokers allow for. */
+
+#define MQTT_MISC_INTERVAL	(MQTT_KEEPALIVE * 1000 / 4)
+
+// Handed from libmosquitto's thread to the gateway's
+
+enum mqtt_event_type
+{
+    MQTT_EVENT_CONNECTED,
+    MQTT_EVENT_DISCONNECTED,
+    MQTT_EVENT_MESSAGE
+};
+
+struct mqtt_event
+{
+    mqtt_event_type type;
+    int rc;
+    struct mosquitto_message* message;
+};
 
 class MQTTGateway
     : public USB
@@ -20,6 +56,16 @@ public:
 
     MQTTGateway(bool verbose);
 
+    /* Let libmosquitto run the connection on a thread of its own,
+       with its own reconnects; call before Init() */
+
+    void SetThreaded(bool threaded) { this->threaded = threaded; }
+
+    /* Topics are "<prefix>/<datapoint>/..."; changing the prefix
+       while connected moves the command subscription over */
+
+    void SetTopics(const std::string& prefix, int subscribe_qos);
+
     virtual bool Init(int epoll_fd,
 		      const char* server,
 		      int port,
@@ -32,6 +78,10 @@ public:
 
 protected:
 
+    // True once the broker has accepted the connection
+
+    bool Connected() const { return connected; }
+
     // Verbose logging
 
     bool verbose;
@@ -40,6 +90,18 @@ protected:
 
     mosquitto* mosq;
 
+    std::string topic_prefix;
+
+    // Levels in the prefix, ie. where the datapoint is in a topic
+
+    int topic_levels;
+
+    /* True if the topic is under the current prefix.  Messages queued
+       before the prefix changed may be under the old one, even with
+       the same number of levels. */
+
+    bool UnderPrefix(const char* topic) const;
+
 private:
 
     static void mqtt_connected(mosquitto* mosq,
@@ -58,11 +120,56 @@ private:
     void MQTTDisconnected(int rc);
     virtual void MQTTMessage(const struct mosquitto_message* message) = 0;
 
-    bool RegisterSocket();
+    // Pass a callback from libmosquitto's thread on to ours
+
+    void Hand(mqtt_event_type type, int rc, const struct mosquitto_message* message);
+    void HandleEvents();
+
+    // Start a connection attempt, or schedule one after a failure
+
+    void Connect();
+    void ScheduleReconnect();
+
+    // Keep epoll in step with mosquitto's socket, which comes and
+    // goes with the connection
+
+    void UpdateSocket();
+
+    void Subscribe();
+
+    int subscribe_qos;
+
+    // Socket registered with epoll, -1 if none
+
+    int socket_fd;
+
+    bool connected;
 
     // Time to reconnect, only set when we have been disconnected
 
     int64_t reconnect_time;
+
+    // When the current connection attempt is given up
+
+    int64_t connect_deadline;
+
+    // Current reconnect backoff in ms
+
+    int reconnect_delay;
+
+    // Next time to call mosquitto_loop_misc()
+
+    int64_t misc_time;
+
+    std::minstd_rand random;
+
+    // Threaded mode; callbacks arrive through the queue, which is
+    // signalled through event_fd
+
+    bool threaded;
+    int event_fd;
+
+    MpscQueue<mqtt_event> events;
 };
 
 #endif
@@ -0,0 +1,85 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include "msgid.h"
+
+MessageIds::MessageIds(int quarantine_time)
+    : next_id(0),
+      quarantine_time(quarantine_time)
+{
+    Reset();
+}
+
+int
+MessageIds::Allocate(int64_t current_time)
+{
+    /* Cycle through the ids rather than always picking the lowest
+       free one, so that an id is reused as late as possible. */
+
+    for (int i = 0; i < MESSAGE_ID_COUNT; ++i)
+    {
+	int id = (next_id + i) % MESSAGE_ID_COUNT;
+
+	if (busy_until[id] <= current_time)
+	{
+	    busy_until[id] = INT64_MAX;
+	    next_id = (id + 1) % MESSAGE_ID_COUNT;
+
+	    return id;
+	}
+    }
+
+    return -1;
+}
+
+void
+MessageIds::Release(int id)
+{
+    if (id >= 0 && id < MESSAGE_ID_COUNT)
+	busy_until[id] = 0;
+}
+
+void
+MessageIds::Quarantine(int id, int64_t current_time)
+{
+    if (id >= 0 && id < MESSAGE_ID_COUNT)
+	busy_until[id] = current_time + quarantine_time;
+}
+
+void
+MessageIds::Reset()
+{
+    for (int i = 0; i < MESSAGE_ID_COUNT; ++i)
+	busy_until[i] = 0;
+}
+
+bool
+MessageIds::Outstanding(int id) const
+{
+    return id >= 0 && id < MESSAGE_ID_COUNT && busy_until[id] == INT64_MAX;
+}
+
+bool
+MessageIds::Quarantined(int id, int64_t current_time) const
+{
+    return (id >= 0 && id < MESSAGE_ID_COUNT &&
+	    busy_until[id] != INT64_MAX &&
+	    busy_until[id] > current_time);
+}
+
+int64_t
+MessageIds::NextRelease(int64_t current_time) const
+{
+    int64_t next = INT64_MAX;
+
+    for (int i = 0; i < MESSAGE_ID_COUNT; ++i)
+	if (busy_until[i] > current_time && busy_until[i] < next)
+	    next = busy_until[i];
+
+    return next;
+}
@@ -0,0 +1,82 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _MSGID_H_
+#define _MSGID_H_
+
+#include <stdint.h>
+
+// The stick only has room for a 4 bit sequence number
+
+#define MESSAGE_ID_COUNT	16
+
+/* This class hands out sequence numbers for messages sent to the
+   stick, making sure that an id is never reused while an ack for it
+   may still arrive.  Otherwise a late ack could be attributed to the
+   wrong message. */
+
+class MessageIds
+{
+public:
+
+    MessageIds(int quarantine_time);
+
+    // Returns a free id, or -1 if all ids are in use
+
+    int Allocate(int64_t current_time);
+
+    // The message was acked; the id can be reused right away
+
+    void Release(int id);
+
+    /* We gave up waiting for an ack.  The stick may still ack the
+       message late, so keep the id out of circulation for a while. */
+
+    void Quarantine(int id, int64_t current_time);
+
+    void SetQuarantineTime(int ms) { quarantine_time = ms; }
+
+    // Forget about all outstanding messages
+
+    void Reset();
+
+    // True if we're waiting for an ack for this id
+
+    bool Outstanding(int id) const;
+
+    /* When the next quarantined id becomes free, or INT64_MAX if
+       none are quarantined */
+
+    int64_t NextRelease(int64_t current_time) const;
+
+    // True if this id timed out and hasn't been reused yet
+
+    bool Quarantined(int id, int64_t current_time) const;
+
+    // For introspection: when the id is free, and where the search
+    // for a free id starts
+
+    int64_t FreeAt(int id) const { return busy_until[id]; }
+    int NextId() const { return next_id; }
+
+private:
+
+    // Time until which the id is unavailable; INT64_MAX while in use
+
+    int64_t busy_until[MESSAGE_ID_COUNT];
+
+    // Where to start looking for the next free id
+
+    int next_id;
+
+    // How long timed out ids are kept out of circulation, in ms
+
+    int quarantine_time;
+};
+
+#endif
@@ -0,0 +1,113 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "notify.h"
+
+ServiceNotifier::ServiceNotifier()
+    : socket_fd(-1),
+      ready(false),
+      ping_interval(0),
+      next_ping(0)
+{
+}
+
+ServiceNotifier::~ServiceNotifier()
+{
+    if (socket_fd != -1)
+	close(socket_fd);
+}
+
+bool
+ServiceNotifier::Init()
+{
+    const char* socket_path = getenv("NOTIFY_SOCKET");
+    const char* usec = getenv("WATCHDOG_USEC");
+    const char* pid = getenv("WATCHDOG_PID");
+
+    if (!socket_path || (socket_path[0] != '/' && socket_path[0] != '@') ||
+	strlen(socket_path) >= sizeof(((sockaddr_un*) 0)->sun_path))
+	return true;
+
+    path = socket_path;
+
+    // The ping interval is for the main process only
+
+    if (usec && (!pid || atol(pid) == getpid()))
+    {
+	ping_interval = atoll(usec) / 2000;
+
+	if (ping_interval < 1 && atoll(usec) > 0)
+	    ping_interval = 1;
+    }
+
+    socket_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+    return socket_fd != -1;
+}
+
+void
+ServiceNotifier::Send(const char* state)
+{
+    sockaddr_un address;
+
+    if (socket_fd == -1)
+	return;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size());
+
+    // A leading '@' is an abstract socket
+
+    if (address.sun_path[0] == '@')
+	address.sun_path[0] = 0;
+
+    if (sendto(socket_fd, state, strlen(state), MSG_NOSIGNAL, (sockaddr*) &address,
+	       offsetof(sockaddr_un, sun_path) + path.size()) < 0 && errno != EAGAIN)
+	perror("sendto");
+}
+
+void
+ServiceNotifier::Ready()
+{
+    if (ready)
+	return;
+
+    ready = true;
+    Send("READY=1");
+}
+
+void
+ServiceNotifier::Stopping()
+{
+    Send("STOPPING=1");
+}
+
+int64_t
+ServiceNotifier::Ping(int64_t current_time)
+{
+    if (socket_fd == -1 || !ping_interval)
+	return INT64_MAX;
+
+    if (next_ping <= current_time)
+    {
+	Send("WATCHDOG=1");
+	next_ping = current_time + ping_interval;
+    }
+
+    return next_ping;
+}
@@ -0,0 +1,60 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _NOTIFY_H_
+#define _NOTIFY_H_
+
+#include <stdint.h>
+#include <string>
+
+/* This class tells systemd about the state of the service, through
+   the socket given in $NOTIFY_SOCKET, with the same datagrams
+   sd_notify() sends; there's no dependency on libsystemd.  When not
+   started by systemd, it does nothing.
+
+   If the unit has WatchdogSec set, the service must send a ping at
+   least that often or be restarted; Ping() sends them at half the
+   interval. */
+
+class ServiceNotifier
+{
+public:
+
+    ServiceNotifier();
+    ~ServiceNotifier();
+
+    // Pick up the socket and watchdog interval from the environment
+
+    bool Init();
+
+    // Started up; only sent once
+
+    void Ready();
+    void Stopping();
+
+    // Send a watchdog ping if one is due; returns when the next one
+    // is, or INT64_MAX if systemd doesn't want them
+
+    int64_t Ping(int64_t current_time);
+
+private:
+
+    void Send(const char* state);
+
+    int socket_fd;
+    std::string path;
+
+    bool ready;
+
+    // Time in ms between pings, 0 if disabled
+
+    int64_t ping_interval;
+    int64_t next_ping;
+};
+
+#endif
@@ -0,0 +1,84 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include "outbox.h"
+
+Outbox::Outbox()
+    : dropped(0)
+{
+}
+
+void
+Outbox::State(int datapoint, int value)
+{
+    // Replaces any older state
+
+    states[datapoint] = value;
+}
+
+void
+Outbox::Event(const char* topic,
+	      const void* payload,
+	      size_t length,
+	      int qos,
+	      bool retain,
+	      int64_t expires)
+{
+    if (events.size() >= OUTBOX_EVENTS)
+    {
+	events.pop_front();
+	dropped++;
+    }
+
+    events.push_back(outbox_event());
+
+    outbox_event& event = events.back();
+
+    event.topic = topic;
+    event.payload.assign((const char*) payload, length);
+    event.qos = qos;
+    event.retain = retain;
+    event.expires = expires;
+}
+
+bool
+Outbox::NextState(int& datapoint, int& value)
+{
+    if (states.empty())
+	return false;
+
+    std::map<int, int>::iterator i = states.begin();
+
+    datapoint = i->first;
+    value = i->second;
+
+    states.erase(i);
+
+    return true;
+}
+
+bool
+Outbox::NextEvent(outbox_event& event, int64_t current_time)
+{
+    while (!events.empty())
+    {
+	if (events.front().expires > current_time)
+	{
+	    event = events.front();
+	    events.pop_front();
+
+	    return true;
+	}
+
+	// Stale by now
+
+	events.pop_front();
+    }
+
+    return false;
+}
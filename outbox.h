@@ -0,0 +1,81 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _OUTBOX_H_
+#define _OUTBOX_H_
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <string>
+
+// Events kept while the broker is unreachable; the oldest are dropped
+
+#define OUTBOX_EVENTS		256
+
+struct outbox_event
+{
+    std::string topic;
+    std::string payload;
+
+    int qos;
+    bool retain;
+
+    // Not worth publishing after this time
+    int64_t expires;
+};
+
+/* This class holds messages that couldn't be published while the
+   broker was unreachable.  Only the latest state of each datapoint
+   is kept, as that's all a subscriber needs to catch up; there's at
+   most one per datapoint.  Other messages are events, which are kept
+   in order until they expire or are pushed out by newer ones. */
+
+class Outbox
+{
+public:
+
+    Outbox();
+
+    void State(int datapoint, int value);
+    void Event(const char* topic,
+	       const void* payload,
+	       size_t length,
+	       int qos,
+	       bool retain,
+	       int64_t expires);
+
+    bool Empty() const { return states.empty() && events.empty(); }
+
+    // True if a state for the datapoint is waiting to be published
+
+    bool HoldsState(int datapoint) const { return states.count(datapoint) != 0; }
+
+    size_t States() const { return states.size(); }
+    size_t Events() const { return events.size(); }
+
+    /* States come in datapoint order; each is the latest for its
+       datapoint, so when it changed doesn't matter.  Events come
+       oldest first.  False if there are none left. */
+
+    bool NextState(int& datapoint, int& value);
+    bool NextEvent(outbox_event& event, int64_t current_time);
+
+    // Events dropped because the buffer was full, since last asked
+
+    unsigned TakeDropped() { unsigned count = dropped; dropped = 0; return count; }
+
+private:
+
+    std::map<int, int> states;
+    std::deque<outbox_event> events;
+
+    unsigned dropped;
+};
+
+#endif
@@ -0,0 +1,88 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <stddef.h>
+#include <atomic>
+
+/* Lock free unbounded queue for any number of producer threads and a
+   single consumer thread (Vyukov's intrusive MPSC queue).  Producers
+   swap themselves in as the newest node and then link the previous
+   one to it; until that link is made, the consumer sees the queue as
+   ending there and picks the item up on a later Pop(). */
+
+template <typename T>
+class MpscQueue
+{
+public:
+
+    MpscQueue()
+	: head(new node),
+	  tail(head.load())
+    {
+    }
+
+    ~MpscQueue()
+    {
+	T item;
+
+	while (Pop(item))
+	    ;
+
+	delete tail;
+    }
+
+    // Producer side; any thread
+
+    void Push(const T& item)
+    {
+	node* n = new node;
+
+	n->item = item;
+
+	node* previous = head.exchange(n, std::memory_order_acq_rel);
+
+	previous->next.store(n, std::memory_order_release);
+    }
+
+    // Consumer side; false if the queue is empty
+
+    bool Pop(T& item)
+    {
+	node* next = tail->next.load(std::memory_order_acquire);
+
+	if (!next)
+	    return false;
+
+	// The node popped becomes the new stub
+
+	item = next->item;
+
+	delete tail;
+	tail = next;
+
+	return true;
+    }
+
+private:
+
+    struct node
+    {
+	node() : next(NULL) {}
+
+	std::atomic<node*> next;
+	T item;
+    };
+
+    std::atomic<node*> head;
+    node* tail;
+};
+
+#endif
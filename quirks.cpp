@@ -0,0 +1,53 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include <stddef.h>
+
+#include "quirks.h"
+
+static const struct
+{
+    unsigned int rf_major;
+    unsigned int rf_minor;
+    unsigned int usb_major;
+    unsigned int usb_minor;
+    unsigned int flags;
+    int max_in_flight;
+    const char* description;
+} quirk_table[] =
+{
+    // Fixed in RF V2.10
+
+    { 2, 8, 2, 5, QUIRK_DIMMER_STATUS_OFF, 1,
+      "dimmer status reports read as off; ignoring them" },
+
+    // Starts dropping messages with 4 or more in parallel
+
+    { 2, 10, 2, 5, 0, 3, NULL },
+};
+
+firmware_quirks
+firmware_quirks_find(unsigned int rf_major,
+		     unsigned int rf_minor,
+		     unsigned int usb_major,
+		     unsigned int usb_minor)
+{
+    firmware_quirks quirks;
+
+    for (size_t i = 0; i < sizeof(quirk_table) / sizeof(quirk_table[0]); ++i)
+	if (quirk_table[i].rf_major == rf_major && quirk_table[i].rf_minor == rf_minor &&
+	    quirk_table[i].usb_major == usb_major && quirk_table[i].usb_minor == usb_minor)
+	{
+	    quirks.flags = quirk_table[i].flags;
+	    quirks.max_in_flight = quirk_table[i].max_in_flight;
+	    quirks.description = quirk_table[i].description;
+	    break;
+	}
+
+    return quirks;
+}
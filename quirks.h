@@ -0,0 +1,40 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _QUIRKS_H_
+#define _QUIRKS_H_
+
+#include <stddef.h>
+
+// Status reports from dimmers read as off, whatever the level
+
+#define QUIRK_DIMMER_STATUS_OFF		(1 << 0)
+
+/* What's known about a firmware release of the stick, looked up from
+   the versions in the MGW_STT_RELEASE reply.  Releases not in the
+   table get the defaults: no quirks and no limits. */
+
+struct firmware_quirks
+{
+    firmware_quirks() : flags(0), max_in_flight(0), description(NULL) {}
+
+    unsigned int flags;
+
+    // Most messages awaiting an ack the stick handles; 0 for no limit
+
+    int max_in_flight;
+
+    const char* description;
+};
+
+firmware_quirks firmware_quirks_find(unsigned int rf_major,
+				     unsigned int rf_minor,
+				     unsigned int usb_major,
+				     unsigned int usb_minor);
+
+#endif
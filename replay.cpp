@@ -0,0 +1,366 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "replay.h"
+#include "wire.h"
+
+static int64_t
+real_time()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (int64_t(tp.tv_sec) * 1000000) + (tp.tv_nsec / 1000);
+}
+
+static std::string
+hex(const std::string& frame)
+{
+    std::string result;
+    char digits[4];
+
+    for (size_t i = 0; i < frame.size(); ++i)
+    {
+	snprintf(digits, sizeof(digits), "%02x", (unsigned char) frame[i]);
+	result += digits;
+    }
+
+    return result;
+}
+
+ReplayTransport::ReplayTransport(const char* path, double speed)
+    : path(path),
+      speed(speed),
+      command(NULL),
+      command_data(NULL),
+      epoll_fd(-1),
+      timer_fd(-1),
+      listener(NULL),
+      have_next(false),
+      capture_start(0),
+      replay_start(0),
+      position(0),
+      base_time(0),
+      sent_pending(false),
+      frames_in(0),
+      frames_out(0),
+      differences(0)
+{
+    for (int i = 0; i < 16; ++i)
+	recorded_datapoint[i] = -1;
+}
+
+bool
+ReplayTransport::Parse(char* options, std::string& path, double& speed)
+{
+    enum { SPEED };
+
+    static char* const tokens[] =
+    {
+	(char*) "speed",
+	NULL
+    };
+
+    char* value;
+    char* comma = strchr(options, ',');
+
+    if (comma)
+	*comma++ = 0;
+
+    path = options;
+    options = comma;
+
+    while (options && *options)
+    {
+	int token = getsubopt(&options, tokens, &value);
+
+	if (token == -1 || !value)
+	    return false;
+
+	switch (token)
+	{
+	case SPEED: speed = atof(value); break;
+	}
+    }
+
+    return !path.empty() && speed >= 0;
+}
+
+void
+ReplayTransport::SetCommandHandler(replay_command_fn command, void* user_data)
+{
+    this->command = command;
+    command_data = user_data;
+}
+
+bool
+ReplayTransport::Init(int fd, TransportListener* listener)
+{
+    epoll_event event;
+
+    epoll_fd = fd;
+    this->listener = listener;
+
+    if (!reader.Open(path.c_str()))
+    {
+	listener->Error("can't read capture %s\n", path.c_str());
+	return false;
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0)
+    {
+	listener->Error("timerfd_create failed %s\n", strerror(errno));
+	return false;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = this;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) < 0)
+    {
+	listener->Error("epoll_ctl failed %s\n", strerror(errno));
+	return false;
+    }
+
+    have_next = reader.Next(next);
+    if (have_next)
+	capture_start = next.time;
+
+    // Time starts now and follows the capture from here on
+
+    base_time = MonotonicClock().Now();
+    replay_start = real_time();
+
+    listener->Info("replaying %s\n", path.c_str());
+
+    Rearm();
+
+    return true;
+}
+
+void
+ReplayTransport::Stop()
+{
+    if (timer_fd != -1)
+    {
+	close(timer_fd);
+	timer_fd = -1;
+    }
+
+    reader.Close();
+}
+
+int64_t
+ReplayTransport::Now() const
+{
+    return base_time + Elapsed() / 1000;
+}
+
+int64_t
+ReplayTransport::Elapsed() const
+{
+    if (speed > 0)
+	return int64_t((real_time() - replay_start) * speed);
+
+    return position;
+}
+
+int
+ReplayTransport::Send(const unsigned char* buffer, size_t length)
+{
+    sent.push_back(std::string((const char*) buffer, length));
+    Compare();
+
+    // The USB transfer itself completes right away
+
+    sent_pending = true;
+    Rearm();
+
+    return 0;
+}
+
+void
+ReplayTransport::Poll(const epoll_event& event)
+{
+    uint64_t expirations;
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+	listener->Error("read failed %s\n", strerror(errno));
+
+    if (sent_pending)
+    {
+	sent_pending = false;
+	listener->FrameSent();
+    }
+
+    if (speed > 0)
+    {
+	int64_t elapsed = Elapsed();
+
+	while (have_next && next.time - capture_start <= elapsed)
+	{
+	    Deliver(next);
+	    have_next = reader.Next(next);
+	}
+    }
+    else if (have_next)
+    {
+	// One step at a time, so the gateway gets to act on each: first
+	// move the clock, so timeouts due before the record expire, then
+	// deliver the record
+
+	if (position < next.time - capture_start)
+	    position = next.time - capture_start;
+	else
+	{
+	    Deliver(next);
+	    have_next = reader.Next(next);
+	}
+    }
+
+    if (!have_next && !sent_pending)
+	Finish();
+    else
+	Rearm();
+}
+
+void
+ReplayTransport::Deliver(const capture_record& record)
+{
+    const unsigned char* frame = record.frame;
+
+    if (record.direction == CAPTURE_IN)
+    {
+	frames_in++;
+
+	if (frame[XC_MSG_TYPE] == MGW_PT_STATUS && frame[XC_STATUS_TYPE] == MGW_STT_OK)
+	{
+	    int datapoint = recorded_datapoint[frame[4] >> 4];
+
+	    // Acked; the next frame with the same command is a new one
+
+	    if (datapoint != -1)
+		unacked[datapoint].clear();
+	}
+
+	listener->FrameReceived(record.frame, record.length);
+	return;
+    }
+
+    frames_out++;
+    recorded.push_back(std::string((const char*) record.frame, record.length));
+
+    if (frame[XC_MSG_TYPE] != MGW_PT_TX)
+    {
+	Compare();
+	return;
+    }
+
+    // Retries in the capture aren't new commands; they're recognised
+    // by repeating an unacked command, with any sequence number
+
+    std::string command_bytes((const char*) frame, XC_TX_SEQ_AND_PRI);
+    int datapoint = frame[XC_TX_DATAPOINT];
+    bool retry = unacked[datapoint] == command_bytes;
+
+    unacked[datapoint] = command_bytes;
+    recorded_datapoint[frame[XC_TX_SEQ_AND_PRI] >> 4] = datapoint;
+
+    if (command && !retry)
+    {
+	int value = (int32_t) xc_load_le32(frame + XC_TX_VALUE);
+
+	switch (frame[XC_TX_EVENT])
+	{
+	case MGW_TE_SWITCH:
+	case MGW_TE_JALO:
+	    command(command_data, datapoint, value, (mci_tx_event) frame[XC_TX_EVENT]);
+	    break;
+
+	case MGW_TE_DIM:
+	    command(command_data, datapoint, value >> 8, MGW_TE_DIM);
+	    break;
+
+	case MGW_TE_REQUEST:
+	    command(command_data, datapoint, -1, MGW_TE_REQUEST);
+	    break;
+
+	default:
+	    break;
+	}
+    }
+
+    Compare();
+}
+
+void
+ReplayTransport::Compare()
+{
+    // Frames are matched in order; retries and sequence numbers
+    // that differ from the capture show up here
+
+    while (!recorded.empty() && !sent.empty())
+    {
+	if (recorded.front() != sent.front())
+	{
+	    differences++;
+	    listener->Info("replay: sent %s, captured %s\n",
+			   hex(sent.front()).c_str(), hex(recorded.front()).c_str());
+	}
+
+	recorded.pop_front();
+	sent.pop_front();
+    }
+}
+
+void
+ReplayTransport::Rearm()
+{
+    itimerspec timer;
+
+    memset(&timer, 0, sizeof(timer));
+
+    if (sent_pending || (have_next && speed <= 0))
+	// Zero would disarm the timer
+
+	timer.it_value.tv_nsec = 1;
+    else if (have_next)
+    {
+	int64_t delay = int64_t((next.time - capture_start - Elapsed()) / speed);
+
+	if (delay > 0)
+	{
+	    timer.it_value.tv_sec = delay / 1000000;
+	    timer.it_value.tv_nsec = (delay % 1000000) * 1000;
+	}
+	else
+	    timer.it_value.tv_nsec = 1;
+    }
+
+    timerfd_settime(timer_fd, 0, &timer, NULL);
+}
+
+void
+ReplayTransport::Finish()
+{
+    listener->Info("replay finished: %u frames from the stick, %u to it, "
+		   "%u sent frames differed, %zu not sent, %zu not captured\n",
+		   frames_in, frames_out, differences, recorded.size(), sent.size());
+
+    listener->TransportFinished();
+}
@@ -0,0 +1,119 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+
+#include "capture.h"
+#include "ckoz0014.h"
+#include "clock.h"
+#include "transport.h"
+
+typedef void (*replay_command_fn)(void* user_data,
+				  int datapoint,
+				  int value,
+				  mci_tx_event event);
+
+/* This class plays a capture back in place of the stick.  Frames
+   from the stick are delivered at their recorded times, and the
+   commands found in the recorded frames to the stick are handed to
+   the command handler, so the gateway sends them again.  The replay
+   is also a clock following the recorded timeline, for the gateway
+   to use in place of the monotonic one.
+
+   A speed of 1 replays in real time, 10 ten times as fast and 0 as
+   fast as possible. */
+
+class ReplayTransport
+    : public Transport,
+      public Clock
+{
+public:
+
+    ReplayTransport(const char* path, double speed);
+
+    void SetCommandHandler(replay_command_fn command, void* user_data);
+
+    virtual bool Init(int epoll_fd, TransportListener* listener);
+    virtual void Stop();
+
+    virtual void Poll(const epoll_event& event);
+
+    virtual int Send(const unsigned char* buffer, size_t length);
+
+    virtual int64_t Now() const;
+
+    // Parse FILE[,speed=N]; false on error
+
+    static bool Parse(char* options, std::string& path, double& speed);
+
+private:
+
+    // Virtual time in microseconds since the start of the capture
+
+    int64_t Elapsed() const;
+
+    void Deliver(const capture_record& record);
+    void Compare();
+    void Rearm();
+    void Finish();
+
+    std::string path;
+    double speed;
+
+    replay_command_fn command;
+    void* command_data;
+
+    int epoll_fd;
+    int timer_fd;
+
+    TransportListener* listener;
+
+    CaptureReader reader;
+
+    capture_record next;
+    bool have_next;
+
+    // Start of the capture, and of the replay in real time
+
+    int64_t capture_start;
+    int64_t replay_start;
+
+    // Virtual time is held at the last record when running as fast
+    // as possible
+
+    int64_t position;
+
+    // Monotonic time at the start of the replay
+
+    int64_t base_time;
+
+    bool sent_pending;
+
+    // Recorded frames to the stick and frames sent by the gateway,
+    // not yet compared
+
+    std::deque<std::string> recorded;
+    std::deque<std::string> sent;
+
+    // Commands in the capture not acked yet, by datapoint, and the
+    // datapoint each recorded sequence number was last used for
+
+    std::string unacked[256];
+    int recorded_datapoint[16];
+
+    unsigned frames_in;
+    unsigned frames_out;
+    unsigned differences;
+};
+
+#endif
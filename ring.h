@@ -0,0 +1,74 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stddef.h>
+#include <atomic>
+
+/* Lock free ring buffer for one producer thread and one consumer
+   thread.  Size must be a power of two.  The producer only writes
+   tail and the consumer only writes head; each publishes its side
+   with release ordering after touching the slot. */
+
+template <typename T, size_t Size>
+class SpscRing
+{
+    static_assert((Size & (Size - 1)) == 0, "ring size must be a power of two");
+
+public:
+
+    SpscRing() : head(0), tail(0) {}
+
+    // Producer side; false if the ring is full
+
+    bool Push(const T& item)
+    {
+	size_t current = tail.load(std::memory_order_relaxed);
+
+	if (current - head.load(std::memory_order_acquire) == Size)
+	    return false;
+
+	items[current & (Size - 1)] = item;
+	tail.store(current + 1, std::memory_order_release);
+
+	return true;
+    }
+
+    // Consumer side; false if the ring is empty
+
+    bool Pop(T& item)
+    {
+	size_t current = head.load(std::memory_order_relaxed);
+
+	if (current == tail.load(std::memory_order_acquire))
+	    return false;
+
+	item = items[current & (Size - 1)];
+	head.store(current + 1, std::memory_order_release);
+
+	return true;
+    }
+
+private:
+
+    T items[Size];
+
+    /* Kept on separate cache lines, so the threads don't contend.
+       Padded rather than aligned, as operator new doesn't honour
+       extended alignment before C++17. */
+
+    char padding_items[64];
+    std::atomic<size_t> head;
+    char padding_head[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail;
+    char padding_tail[64 - sizeof(std::atomic<size_t>)];
+};
+
+#endif
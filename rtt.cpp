@@ -0,0 +1,71 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+
+#include "rtt.h"
+
+RttEstimator::RttEstimator()
+    : srtt(-1),
+      rttvar(0),
+      backoff(0)
+{
+}
+
+void
+RttEstimator::Sample(int rtt)
+{
+    if (rtt < 0)
+	rtt = 0;
+
+    if (srtt == -1)
+    {
+	srtt = rtt;
+	rttvar = rtt / 2;
+    }
+    else
+    {
+	rttvar = (3 * rttvar + abs(srtt - rtt)) / 4;
+	srtt = (7 * srtt + rtt) / 8;
+    }
+
+    backoff = 0;
+}
+
+void
+RttEstimator::Backoff()
+{
+    // No point in counting beyond what takes us to the ceiling
+
+    if (backoff < 16)
+	backoff++;
+}
+
+int
+RttEstimator::Timeout() const
+{
+    int timeout;
+
+    if (srtt == -1)
+	// Nothing measured yet; be conservative
+
+	return RTO_MAX;
+
+    timeout = srtt + (4 * rttvar > 10 ? 4 * rttvar : 10);
+
+    if (timeout < RTO_MIN)
+	timeout = RTO_MIN;
+
+    for (int i = 0; i < backoff && timeout < RTO_MAX; ++i)
+	timeout *= 2;
+
+    if (timeout > RTO_MAX)
+	timeout = RTO_MAX;
+
+    return timeout;
+}
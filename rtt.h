@@ -0,0 +1,58 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _RTT_H_
+#define _RTT_H_
+
+/* Bounds for the ack timeout, in ms.  Retrying faster than the floor
+   only makes the stick report that it's busy; the ceiling is what we
+   used to wait unconditionally. */
+
+#define RTO_MIN			300
+#define RTO_MAX			5500
+
+/* This class estimates how long to wait for an ack before resending,
+   from observed round trip times.  It follows TCP (RFC 6298): a
+   smoothed round trip time plus four times its mean deviation,
+   doubled for each consecutive timeout. */
+
+class RttEstimator
+{
+public:
+
+    RttEstimator();
+
+    // An ack arrived this many ms after the message was sent
+
+    void Sample(int rtt);
+
+    // We timed out waiting for an ack
+
+    void Backoff();
+
+    // Current ack timeout in ms
+
+    int Timeout() const;
+
+    // Smoothed round trip time, or -1 if there are no samples yet
+
+    int Smoothed() const { return srtt; }
+
+    int Variance() const { return rttvar; }
+
+private:
+
+    int srtt;
+    int rttvar;
+
+    // Number of consecutive timeouts
+
+    int backoff;
+};
+
+#endif
@@ -0,0 +1,214 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+/*
+ *  Fast-forward soak test.  Runs the gateway against an emulated
+ *  stick on a simulated clock, so that hours of commands, losses,
+ *  retries and timeouts go by in seconds.  The clock is stepped from
+ *  one deadline to the next; nothing ever sleeps.
+ *
+ *  At the end, commands stop and the queue is left to drain.  Every
+ *  device should then hold the last value it was set to, unless the
+ *  gateway gave up on a change on the way; more devices off than
+ *  changes given up is a failure.
+ *
+ *  The broker isn't needed; states published while it's away are
+ *  kept in the outbox.  The parser prints some frames to stdout;
+ *  stdout is sent to /dev/null while the test runs, and the results
+ *  go to the original stdout.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <mosquitto.h>
+
+#include <random>
+
+#include <sys/epoll.h>
+
+#include "gateway.h"
+#include "emulator.h"
+
+#define SIM_DEVICES		20
+
+// Mean time in ms between commands
+
+#define SIM_COMMAND_INTERVAL	2000
+
+// Time in ms the queue is given to drain at the end
+
+#define SIM_DRAIN_TIME		(10 * 60 * 1000)
+
+class SimGateway
+    : public XCtoMQTT
+{
+public:
+
+    SimGateway()
+	: XCtoMQTT(false, false, 0, 60)
+    {
+    }
+
+    // Only the stick; there's no broker
+
+    bool Start(int epoll_fd) { return USB::Init(epoll_fd); }
+
+    uint64_t GivenUp() const { return Statistics().Global().given_up; }
+
+protected:
+
+    virtual void Error(const char* fmt, ...) {}
+    virtual void Info(const char* fmt, ...) {}
+};
+
+static int64_t
+now_ms()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (int64_t(tp.tv_sec) * 1000) + (tp.tv_nsec / 1000000);
+}
+
+int
+main(int argc, char* argv[])
+{
+    double hours = argc > 1 ? atof(argv[1]) : 24;
+    unsigned int seed = argc > 2 ? atoi(argv[2]) : 1;
+
+    // Results go to the original stdout
+
+    FILE* report = fdopen(dup(STDOUT_FILENO), "w");
+
+    if (!report || !freopen("/dev/null", "w", stdout))
+	return 1;
+
+    SimulatedClock clock;
+    emulator_config config;
+
+    config.devices = SIM_DEVICES;
+    config.latency = 80;
+    config.jitter = 100;
+    config.loss = 0.2;
+    config.busy = 0.05;
+
+    // Devices aren't operated locally, so the final values are known
+
+    config.status_rate = 0;
+    config.seed = seed;
+
+    EmulatedStick stick(config, &clock);
+    SimGateway gateway;
+    gateway_config settings;
+
+    gateway.SetTransport(&stick);
+    gateway.SetClock(&clock);
+    gateway.Configure(settings);
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (epoll_fd < 0 || !gateway.Start(epoll_fd))
+    {
+	fprintf(stderr, "can't start the emulated stick\n");
+	return 1;
+    }
+
+    std::minstd_rand random(seed);
+    std::exponential_distribution<double> interval(1.0 / SIM_COMMAND_INTERVAL);
+    std::uniform_int_distribution<int> pick_datapoint(1, SIM_DEVICES);
+    std::uniform_int_distribution<int> pick_value(0, 100);
+
+    int expected[SIM_DEVICES + 1];
+
+    for (int i = 0; i <= SIM_DEVICES; ++i)
+	expected[i] = -1;
+
+    int64_t end = int64_t(hours * 3600 * 1000);
+    int64_t drained = end + SIM_DRAIN_TIME;
+    int64_t next_command = int64_t(interval(random));
+    int64_t started = now_ms();
+    uint64_t steps = 0;
+    uint64_t commands = 0;
+
+    while (clock.Now() < drained)
+    {
+	if (next_command <= clock.Now())
+	{
+	    int datapoint = pick_datapoint(random);
+	    int value = pick_value(random);
+
+	    gateway.SendDPValue(datapoint, value, MGW_TE_DIM);
+	    expected[datapoint] = value;
+	    commands++;
+
+	    next_command += 1 + int64_t(interval(random));
+	    if (next_command >= end)
+		next_command = INT64_MAX;
+	}
+
+	// Jump straight to whatever is due first
+
+	int timeout = gateway.Prepoll(epoll_fd);
+	int64_t next = drained;
+
+	if (timeout >= 0 && timeout != INT_MAX && clock.Now() + timeout < next)
+	    next = clock.Now() + timeout;
+	if (stick.NextEvent() < next)
+	    next = stick.NextEvent();
+	if (next_command < next)
+	    next = next_command;
+
+	clock.Set(next);
+
+	// The stick delivers what's due by the clock, whatever woke it
+
+	epoll_event event;
+
+	event.events = EPOLLIN;
+	event.data.ptr = &stick;
+	gateway.Poll(event);
+
+	steps++;
+    }
+
+    int wrong = 0;
+
+    for (int datapoint = 1; datapoint <= SIM_DEVICES; ++datapoint)
+	if (expected[datapoint] != -1 && stick.DeviceValue(datapoint) != expected[datapoint])
+	{
+	    fprintf(report, "DP %d is %d, last set to %d\n",
+		    datapoint, stick.DeviceValue(datapoint), expected[datapoint]);
+	    wrong++;
+	}
+
+    fprintf(report, "%.1f simulated hours in %.2f s: %llu steps, %llu commands, "
+	    "%llu frames to the stick, %llu from it, %llu changes given up\n",
+	    hours, (now_ms() - started) / 1000.0,
+	    (unsigned long long) steps, (unsigned long long) commands,
+	    (unsigned long long) stick.FramesSent(), (unsigned long long) stick.FramesReceived(),
+	    (unsigned long long) gateway.GivenUp());
+
+    gateway.Stop();
+
+    int status = 0;
+
+    if ((uint64_t) wrong > gateway.GivenUp())
+    {
+	fprintf(report, "%d devices off, more than the changes given up\n", wrong);
+	status = 1;
+    }
+    else
+	fprintf(report, "all checks passed\n");
+
+    fclose(report);
+
+    return status;
+}
@@ -0,0 +1,609 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "stats.h"
+
+const char* stats_error_name(int error_class)
+{
+    switch (error_class)
+    {
+    case 0:                   return "general";
+    case 1:                   return "unknown";
+    case 2:                   return "dp_oor";
+    case 3:                   return "busy_mrf";
+    case 4:                   return "busy_mrf_rx";
+    case 5:                   return "tx_msg_lost";
+    case 6:                   return "no_ack";
+    case STATS_ERROR_TIMEOUT: return "timeout";
+    default:                  return "other";
+    }
+}
+
+Histogram::Histogram()
+    : count(0),
+      sum(0),
+      max(0)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+	buckets[i] = 0;
+}
+
+int
+Histogram::BucketIndex(int64_t value)
+{
+    if (value < 0)
+	value = 0;
+
+    if (value < HISTOGRAM_SUB_COUNT)
+	return value;
+
+    int msb = 63 - __builtin_clzll(value);
+
+    if (msb >= HISTOGRAM_MAX_BITS)
+	return HISTOGRAM_BUCKETS - 1;
+
+    int shift = msb - HISTOGRAM_SUB_BITS;
+
+    return shift * HISTOGRAM_SUB_COUNT + (value >> shift);
+}
+
+int64_t
+Histogram::BucketHighest(int index)
+{
+    if (index < 2 * HISTOGRAM_SUB_COUNT)
+	return index;
+
+    int shift = index / HISTOGRAM_SUB_COUNT - 1;
+    int64_t lowest = int64_t(index - shift * HISTOGRAM_SUB_COUNT) << shift;
+
+    return lowest + (int64_t(1) << shift) - 1;
+}
+
+void
+Histogram::Record(int64_t value)
+{
+    buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+
+    int64_t current = max.load(std::memory_order_relaxed);
+
+    while (value > current &&
+	   !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+	;
+}
+
+int64_t
+Histogram::Percentile(double percentile) const
+{
+    uint64_t total = Count();
+
+    if (!total)
+	return 0;
+
+    uint64_t wanted = uint64_t(total * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (wanted < 1)
+	wanted = 1;
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+	seen += Bucket(i);
+
+	if (seen >= wanted)
+	{
+	    int64_t highest = BucketHighest(i);
+
+	    // Don't report more than was actually seen
+
+	    return highest < Max() ? highest : Max();
+	}
+    }
+
+    return Max();
+}
+
+rf_stats::rf_stats()
+    : given_up(0)
+{
+    for (int i = 0; i < STATS_ERROR_CLASSES; ++i)
+	errors[i] = 0;
+}
+
+Stats::Stats()
+    : wakeups(0),
+      wakeup_rate(0)
+{
+    for (int i = 0; i < STATS_DATAPOINTS; ++i)
+	datapoints[i] = NULL;
+}
+
+Stats::~Stats()
+{
+    for (int i = 0; i < STATS_DATAPOINTS; ++i)
+	delete datapoints[i].load();
+}
+
+rf_stats*
+Stats::Get(int datapoint)
+{
+    if (datapoint < 0 || datapoint >= STATS_DATAPOINTS)
+	return NULL;
+
+    rf_stats* stats = datapoints[datapoint].load(std::memory_order_acquire);
+
+    if (!stats)
+    {
+	// Only the gateway thread records, so no need to race here
+
+	stats = new rf_stats;
+	datapoints[datapoint].store(stats, std::memory_order_release);
+    }
+
+    return stats;
+}
+
+const rf_stats*
+Stats::Datapoint(int datapoint) const
+{
+    if (datapoint < 0 || datapoint >= STATS_DATAPOINTS)
+	return NULL;
+
+    return datapoints[datapoint].load(std::memory_order_acquire);
+}
+
+void
+Stats::AckLatency(int datapoint, int64_t ms)
+{
+    rf_stats* stats = Get(datapoint);
+
+    global.ack_latency.Record(ms);
+
+    if (stats)
+	stats->ack_latency.Record(ms);
+}
+
+void
+Stats::Completed(int datapoint, int transmissions, bool success)
+{
+    rf_stats* stats = Get(datapoint);
+
+    global.transmissions.Record(transmissions);
+
+    if (stats)
+	stats->transmissions.Record(transmissions);
+
+    if (!success)
+    {
+	global.given_up.fetch_add(1, std::memory_order_relaxed);
+
+	if (stats)
+	    stats->given_up.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void
+Stats::Failure(int datapoint, int error_class)
+{
+    rf_stats* stats = Get(datapoint);
+
+    if (error_class < 0 || error_class >= STATS_ERROR_CLASSES)
+	error_class = STATS_ERROR_OTHER;
+
+    global.errors[error_class].fetch_add(1, std::memory_order_relaxed);
+
+    if (stats)
+	stats->errors[error_class].fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+string_append(std::string& out, const char* fmt, ...)
+{
+    char buffer[256];
+    va_list argptr;
+
+    va_start(argptr, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, argptr);
+    va_end(argptr);
+
+    out += buffer;
+}
+
+void
+Stats::FormatJSON(const rf_stats& stats, std::string& out) const
+{
+    const Histogram& latency = stats.ack_latency;
+    const Histogram& transmissions = stats.transmissions;
+
+    string_append(out, "{\"acks\":%llu,\"latency_ms\":{\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"max\":%lld,\"mean\":%lld}",
+		  (unsigned long long) latency.Count(),
+		  (long long) latency.Percentile(50),
+		  (long long) latency.Percentile(90),
+		  (long long) latency.Percentile(99),
+		  (long long) latency.Max(),
+		  (long long) (latency.Count() ? latency.Sum() / latency.Count() : 0));
+
+    out += ",\"transmissions\":{";
+
+    bool first = true;
+
+    for (int i = 0; i < HISTOGRAM_SUB_COUNT; ++i)
+	if (transmissions.Bucket(i))
+	{
+	    string_append(out, "%s\"%d\":%llu", first ? "" : ",", i, (unsigned long long) transmissions.Bucket(i));
+	    first = false;
+	}
+
+    string_append(out, "},\"given_up\":%llu,\"errors\":{",
+		  (unsigned long long) stats.given_up.load(std::memory_order_relaxed));
+
+    for (int i = 0; i < STATS_ERROR_CLASSES; ++i)
+	string_append(out, "%s\"%s\":%llu", i ? "," : "", stats_error_name(i),
+		      (unsigned long long) stats.errors[i].load(std::memory_order_relaxed));
+
+    out += "}";
+
+    if (&stats == &global)
+	string_append(out, ",\"wakeups_per_s\":%.2f", wakeup_rate);
+
+    out += "}";
+}
+
+static void
+format_prometheus(const rf_stats& stats, const char* datapoint, std::string& out)
+{
+    static const double quantiles[] = { 50, 90, 99 };
+    const Histogram& latency = stats.ack_latency;
+
+    for (unsigned i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i)
+	string_append(out, "xcomfort_ack_latency_ms{datapoint=\"%s\",quantile=\"%g\"} %lld\n",
+		      datapoint, quantiles[i] / 100, (long long) latency.Percentile(quantiles[i]));
+
+    string_append(out, "xcomfort_ack_latency_ms_sum{datapoint=\"%s\"} %llu\n",
+		  datapoint, (unsigned long long) latency.Sum());
+    string_append(out, "xcomfort_ack_latency_ms_count{datapoint=\"%s\"} %llu\n",
+		  datapoint, (unsigned long long) latency.Count());
+
+    for (int i = 0; i < HISTOGRAM_SUB_COUNT; ++i)
+	if (stats.transmissions.Bucket(i))
+	    string_append(out, "xcomfort_changes_total{datapoint=\"%s\",transmissions=\"%d\"} %llu\n",
+			  datapoint, i, (unsigned long long) stats.transmissions.Bucket(i));
+
+    string_append(out, "xcomfort_given_up_total{datapoint=\"%s\"} %llu\n",
+		  datapoint, (unsigned long long) stats.given_up.load(std::memory_order_relaxed));
+
+    for (int i = 0; i < STATS_ERROR_CLASSES; ++i)
+	if (stats.errors[i].load(std::memory_order_relaxed))
+	    string_append(out, "xcomfort_errors_total{datapoint=\"%s\",class=\"%s\"} %llu\n",
+			  datapoint, stats_error_name(i),
+			  (unsigned long long) stats.errors[i].load(std::memory_order_relaxed));
+}
+
+void
+Stats::FormatPrometheus(std::string& out) const
+{
+    out += "# TYPE xcomfort_ack_latency_ms summary\n";
+    out += "# TYPE xcomfort_changes_total counter\n";
+    out += "# TYPE xcomfort_given_up_total counter\n";
+    out += "# TYPE xcomfort_errors_total counter\n";
+
+    format_prometheus(global, "all", out);
+
+    out += "# TYPE xcomfort_wakeups_total counter\n";
+    string_append(out, "xcomfort_wakeups_total %llu\n", (unsigned long long) Wakeups());
+
+    for (int i = 0; i < STATS_DATAPOINTS; ++i)
+    {
+	const rf_stats* stats = Datapoint(i);
+
+	if (stats)
+	{
+	    char datapoint[8];
+
+	    snprintf(datapoint, sizeof(datapoint), "%d", i);
+	    format_prometheus(*stats, datapoint, out);
+	}
+    }
+}
+
+StatsServer::StatsServer(const Stats& stats)
+    : stats(stats),
+      epoll_fd(-1),
+      fd(-1)
+{
+}
+
+bool
+StatsServer::Init(int epoll_fd, int port)
+{
+    sockaddr_in address;
+    epoll_event event;
+    int one = 1;
+
+    this->epoll_fd = epoll_fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+	return false;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (sockaddr*) &address, sizeof(address)) < 0 ||
+	listen(fd, 4) < 0)
+    {
+	Stop();
+	return false;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = this;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+	Stop();
+	return false;
+    }
+
+    return true;
+}
+
+void
+StatsServer::Stop()
+{
+    for (int i = 0; i < STATS_MAX_CLIENTS; ++i)
+	Close(clients[i]);
+
+    if (fd != -1)
+    {
+	close(fd);
+	fd = -1;
+    }
+}
+
+bool
+StatsServer::Owns(const epoll_event& event) const
+{
+    if (fd == -1)
+	return false;
+
+    return event.data.ptr == this ||
+	(event.data.ptr >= (void*) clients && event.data.ptr < (void*) (clients + STATS_MAX_CLIENTS));
+}
+
+void
+StatsServer::Poll(const epoll_event& event, int64_t current_time)
+{
+    if (event.data.ptr == this)
+	Accept(current_time);
+    else
+	Serve(*(stats_client*) event.data.ptr);
+}
+
+void
+StatsServer::Accept(int64_t current_time)
+{
+    for (;;)
+    {
+	int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+	if (client_fd < 0)
+	    return;
+
+	stats_client* client = NULL;
+
+	for (int i = 0; i < STATS_MAX_CLIENTS && !client; ++i)
+	    if (clients[i].state == STATS_CLIENT_FREE)
+		client = &clients[i];
+
+	if (!client)
+	{
+	    // Busy; try again later
+
+	    close(client_fd);
+	    continue;
+	}
+
+	client->state = STATS_CLIENT_REQUEST;
+	client->fd = client_fd;
+	client->request.clear();
+	client->response.clear();
+	client->sent = 0;
+	client->deadline = current_time + STATS_CLIENT_TIMEOUT;
+
+	if (!Watch(*client, EPOLLIN, EPOLL_CTL_ADD))
+	    Close(*client);
+    }
+}
+
+void
+StatsServer::Serve(stats_client& client)
+{
+    switch (client.state)
+    {
+    case STATS_CLIENT_REQUEST:
+	{
+	    bool open = Read(client, true);
+
+	    if (client.request.size() > STATS_MAX_REQUEST)
+	    {
+		Close(client);
+		return;
+	    }
+
+	    /* The request itself is of no interest; everyone gets the
+	       same answer once the headers are in. */
+
+	    if (client.request.find("\r\n\r\n") == std::string::npos && open)
+		return;
+
+	    if (client.request.empty())
+	    {
+		Close(client);
+		return;
+	    }
+
+	    std::string body;
+
+	    stats.FormatPrometheus(body);
+
+	    string_append(client.response, "HTTP/1.0 200 OK\r\n"
+			  "Content-Type: text/plain; version=0.0.4\r\n"
+			  "Content-Length: %zu\r\n"
+			  "Connection: close\r\n\r\n", body.size());
+	    client.response += body;
+	    client.state = STATS_CLIENT_RESPONSE;
+
+	    if (!Watch(client, EPOLLOUT, EPOLL_CTL_MOD))
+	    {
+		Close(client);
+		return;
+	    }
+
+	    Write(client);
+	}
+	break;
+
+    case STATS_CLIENT_RESPONSE:
+	Write(client);
+	break;
+
+    case STATS_CLIENT_LINGER:
+	if (!Read(client, false))
+	    Close(client);
+	break;
+
+    case STATS_CLIENT_FREE:
+	break;
+    }
+}
+
+bool
+StatsServer::Read(stats_client& client, bool keep)
+{
+    char buffer[512];
+
+    for (;;)
+    {
+	ssize_t length = read(client.fd, buffer, sizeof(buffer));
+
+	if (length > 0)
+	{
+	    if (keep)
+	    {
+		client.request.append(buffer, length);
+
+		if (client.request.size() > STATS_MAX_REQUEST)
+		    return true;
+	    }
+
+	    continue;
+	}
+
+	if (length < 0 && errno == EINTR)
+	    continue;
+
+	return length < 0 && errno == EAGAIN;
+    }
+}
+
+void
+StatsServer::Write(stats_client& client)
+{
+    while (client.sent < client.response.size())
+    {
+	ssize_t written = write(client.fd, client.response.data() + client.sent,
+				client.response.size() - client.sent);
+
+	if (written < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+
+	    // The rest goes when the socket is writable again
+
+	    if (errno != EAGAIN)
+		Close(client);
+
+	    return;
+	}
+
+	client.sent += written;
+    }
+
+    shutdown(client.fd, SHUT_WR);
+
+    client.response.clear();
+    client.state = STATS_CLIENT_LINGER;
+
+    if (!Watch(client, EPOLLIN, EPOLL_CTL_MOD))
+	Close(client);
+}
+
+void
+StatsServer::Close(stats_client& client)
+{
+    if (client.fd != -1)
+    {
+	// Closing removes it from epoll
+
+	close(client.fd);
+	client.fd = -1;
+    }
+
+    client.state = STATS_CLIENT_FREE;
+    client.request.clear();
+    client.response.clear();
+}
+
+bool
+StatsServer::Watch(stats_client& client, uint32_t events, int op)
+{
+    epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = &client;
+
+    return epoll_ctl(epoll_fd, op, client.fd, &event) == 0;
+}
+
+int64_t
+StatsServer::Expire(int64_t current_time)
+{
+    int64_t next = INT64_MAX;
+
+    for (int i = 0; i < STATS_MAX_CLIENTS; ++i)
+    {
+	if (clients[i].state == STATS_CLIENT_FREE)
+	    continue;
+
+	if (clients[i].deadline <= current_time)
+	    Close(clients[i]);
+	else if (clients[i].deadline < next)
+	    next = clients[i].deadline;
+    }
+
+    return next;
+}
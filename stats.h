@@ -0,0 +1,232 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+struct epoll_event;
+
+/* Histogram buckets are split by power of two, and each power of two
+   is split into HISTOGRAM_SUB_COUNT linear sub-buckets.  This keeps
+   the relative error below 1/HISTOGRAM_SUB_COUNT over the whole
+   range.  Values of 2^HISTOGRAM_MAX_BITS and above end up in the last
+   bucket. */
+
+#define HISTOGRAM_SUB_BITS	3
+#define HISTOGRAM_SUB_COUNT	(1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS	16
+#define HISTOGRAM_BUCKETS	((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+// Datapoints are numbered 0-255 by the stick
+
+#define STATS_DATAPOINTS	256
+
+/* Error classes; the first ones match mstt_error as reported by the
+   stick, the rest are detected by us. */
+
+#define STATS_ERROR_TIMEOUT	7
+#define STATS_ERROR_OTHER	8
+#define STATS_ERROR_CLASSES	9
+
+const char* stats_error_name(int error_class);
+
+// printf onto the end of a string, for building the formats below
+
+void string_append(std::string& out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* HdrHistogram style histogram.  All counters are atomic and updated
+   with relaxed ordering, so that recording never takes a lock and the
+   histogram can be read from another thread. */
+
+class Histogram
+{
+public:
+
+    Histogram();
+
+    void Record(int64_t value);
+
+    uint64_t Count() const { return count.load(std::memory_order_relaxed); }
+    uint64_t Sum() const { return sum.load(std::memory_order_relaxed); }
+    int64_t Max() const { return max.load(std::memory_order_relaxed); }
+
+    // Highest value equivalent to the given percentile (0-100)
+
+    int64_t Percentile(double percentile) const;
+
+    uint64_t Bucket(int index) const { return buckets[index].load(std::memory_order_relaxed); }
+
+    static int BucketIndex(int64_t value);
+    static int64_t BucketHighest(int index);
+
+private:
+
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<int64_t> max;
+};
+
+// RF quality metrics, kept per datapoint and globally
+
+struct rf_stats
+{
+    rf_stats();
+
+    // Time in ms from a message was sent until it was acked
+
+    Histogram ack_latency;
+
+    // Messages needed to get a change through
+
+    Histogram transmissions;
+
+    // Changes we gave up on after the last retry
+
+    std::atomic<uint64_t> given_up;
+
+    // Failed messages, by error class
+
+    std::atomic<uint64_t> errors[STATS_ERROR_CLASSES];
+};
+
+class Stats
+{
+public:
+
+    Stats();
+    ~Stats();
+
+    // A message to the datapoint was acked after the given time
+
+    void AckLatency(int datapoint, int64_t ms);
+
+    // A change was completed, or given up on
+
+    void Completed(int datapoint, int transmissions, bool success);
+
+    // A message to the datapoint failed
+
+    void Failure(int datapoint, int error_class);
+
+    // The gateway's event loop woke up
+
+    void Wakeup() { wakeups.fetch_add(1, std::memory_order_relaxed); }
+    uint64_t Wakeups() const { return wakeups.load(std::memory_order_relaxed); }
+
+    // Wakeups per second over the last statistics interval, for the
+    // JSON statistics
+
+    void SetWakeupRate(double rate) { wakeup_rate = rate; }
+
+    const rf_stats& Global() const { return global; }
+
+    // Returns NULL for datapoints that haven't seen any traffic
+
+    const rf_stats* Datapoint(int datapoint) const;
+
+    void FormatJSON(const rf_stats& stats, std::string& out) const;
+    void FormatPrometheus(std::string& out) const;
+
+private:
+
+    rf_stats* Get(int datapoint);
+
+    rf_stats global;
+
+    std::atomic<uint64_t> wakeups;
+    double wakeup_rate;
+
+    // Allocated on first use
+
+    std::atomic<rf_stats*> datapoints[STATS_DATAPOINTS];
+};
+
+/* Clients served at the same time; more are turned away.  A request
+   may be at most STATS_MAX_REQUEST bytes, and a client has
+   STATS_CLIENT_TIMEOUT ms from connecting to having read the
+   response. */
+
+#define STATS_MAX_CLIENTS	4
+#define STATS_MAX_REQUEST	4096
+#define STATS_CLIENT_TIMEOUT	5000
+
+enum stats_client_state
+{
+    STATS_CLIENT_FREE,
+    STATS_CLIENT_REQUEST,
+    STATS_CLIENT_RESPONSE,
+
+    // Response sent; waiting for the client to close, so that unread
+    // bytes don't make the kernel reset the connection
+
+    STATS_CLIENT_LINGER
+};
+
+struct stats_client
+{
+    stats_client() : state(STATS_CLIENT_FREE), fd(-1), sent(0), deadline(0) {}
+
+    stats_client_state state;
+    int fd;
+
+    std::string request;
+    std::string response;
+    size_t sent;
+
+    int64_t deadline;
+};
+
+/* Serves the statistics in Prometheus text format to anyone
+   connecting to the given port on localhost.  Clients are served
+   from the event loop without blocking, so a client that doesn't
+   read can't hold up the gateway. */
+
+class StatsServer
+{
+public:
+
+    StatsServer(const Stats& stats);
+
+    bool Init(int epoll_fd, int port);
+    void Stop();
+
+    bool Owns(const epoll_event& event) const;
+    void Poll(const epoll_event& event, int64_t current_time);
+
+    // Drop clients that have run out of time; returns when the next
+    // one does, or INT64_MAX
+
+    int64_t Expire(int64_t current_time);
+
+private:
+
+    void Accept(int64_t current_time);
+    void Serve(stats_client& client);
+
+    // Read what's there; false once the client has closed or failed
+
+    bool Read(stats_client& client, bool keep);
+    void Write(stats_client& client);
+    void Close(stats_client& client);
+
+    bool Watch(stats_client& client, uint32_t events, int op);
+
+    const Stats& stats;
+
+    int epoll_fd;
+    int fd;
+
+    stats_client clients[STATS_MAX_CLIENTS];
+};
+
+#endif
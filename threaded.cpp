@@ -0,0 +1,316 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "threaded.h"
+
+static void
+signal_fd(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	perror("write");
+}
+
+static void
+clear_fd(int fd)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+	perror("read");
+}
+
+ThreadedTransport::ThreadedTransport(Transport* transport)
+    : transport(transport),
+      listener(NULL),
+      epoll_fd(-1),
+      thread_epoll_fd(-1),
+      inbound_fd(-1),
+      outbound_fd(-1),
+      stopping(false),
+      reset_requested(false)
+{
+}
+
+bool
+ThreadedTransport::Init(int fd, TransportListener* listener)
+{
+    epoll_event event;
+
+    epoll_fd = fd;
+    this->listener = listener;
+
+    thread_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    inbound_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    outbound_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (thread_epoll_fd < 0 || inbound_fd < 0 || outbound_fd < 0)
+    {
+	listener->Error("failed to create descriptors %s\n", strerror(errno));
+	return false;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = this;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inbound_fd, &event) < 0 ||
+	epoll_ctl(thread_epoll_fd, EPOLL_CTL_ADD, outbound_fd, &event) < 0)
+    {
+	listener->Error("epoll_ctl failed %s\n", strerror(errno));
+	return false;
+    }
+
+    // Set up on this thread; the transport reports through the ring
+    // from the start
+
+    if (!transport->Init(thread_epoll_fd, this))
+	return false;
+
+    thread = std::thread(&ThreadedTransport::Run, this);
+
+    return true;
+}
+
+void
+ThreadedTransport::Stop()
+{
+    if (thread.joinable())
+    {
+	stopping = true;
+	signal_fd(outbound_fd);
+
+	thread.join();
+    }
+
+    transport->Stop();
+
+    if (inbound_fd != -1)
+	close(inbound_fd);
+    if (outbound_fd != -1)
+	close(outbound_fd);
+    if (thread_epoll_fd != -1)
+	close(thread_epoll_fd);
+
+    inbound_fd = outbound_fd = thread_epoll_fd = -1;
+}
+
+void
+ThreadedTransport::Run()
+{
+    sigset_t signals;
+
+    // Signals are for the gateway thread
+
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    while (!stopping)
+    {
+	epoll_event event;
+	int events = epoll_wait(thread_epoll_fd, &event, 1, -1);
+
+	if (events < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+
+	    listener->Error("epoll_wait failed %s\n", strerror(errno));
+	    Deliver(THREADED_FAILED);
+	    break;
+	}
+
+	if (events == 0)
+	    continue;
+
+	if (event.data.ptr != this)
+	{
+	    transport->Poll(event);
+	    continue;
+	}
+
+	threaded_frame frame;
+
+	clear_fd(outbound_fd);
+
+	if (reset_requested.exchange(false))
+	    transport->Reset();
+
+	/* A frame that can't be sent comes back as a lost or failed
+	   stick, reported by the transport and passed on like any other
+	   event, so the gateway sees what it would have without the
+	   thread. */
+
+	while (outbound.Pop(frame))
+	    transport->Send(frame.frame, frame.length);
+    }
+}
+
+int
+ThreadedTransport::Send(const unsigned char* buffer, size_t length)
+{
+    threaded_frame frame;
+
+    if (length > INTR_SEND_LENGTH)
+	length = INTR_SEND_LENGTH;
+
+    frame.event = THREADED_FRAME_SENT;
+    frame.length = length;
+    memcpy(frame.frame, buffer, length);
+
+    if (!outbound.Push(frame))
+	return -1;
+
+    signal_fd(outbound_fd);
+
+    return 0;
+}
+
+void
+ThreadedTransport::Reset()
+{
+    reset_requested = true;
+    signal_fd(outbound_fd);
+}
+
+void
+ThreadedTransport::Poll(const epoll_event& event)
+{
+    threaded_frame frame;
+
+    clear_fd(inbound_fd);
+
+    while (inbound.Pop(frame))
+	switch (frame.event)
+	{
+	case THREADED_FRAME_RECEIVED:
+	    listener->FrameReceived(frame.frame, frame.length);
+	    break;
+
+	case THREADED_FRAME_SENT:
+	    listener->FrameSent();
+	    break;
+
+	case THREADED_FAILED:
+	    listener->TransportFailed();
+	    break;
+
+	case THREADED_FINISHED:
+	    listener->TransportFinished();
+	    break;
+
+	case THREADED_LOST:
+	    listener->TransportLost();
+	    break;
+
+	case THREADED_RESTORED:
+	    listener->TransportRestored();
+	    break;
+	}
+}
+
+void
+ThreadedTransport::Deliver(threaded_event event, const unsigned char* buffer, size_t length)
+{
+    threaded_frame frame;
+
+    if (length > INTR_RECV_LENGTH)
+	length = INTR_RECV_LENGTH;
+
+    frame.event = event;
+    frame.length = length;
+
+    if (length)
+	memcpy(frame.frame, buffer, length);
+
+    // The gateway is far behind; wait for it rather than drop frames
+
+    while (!inbound.Push(frame))
+    {
+	if (stopping)
+	    return;
+
+	usleep(1000);
+    }
+
+    signal_fd(inbound_fd);
+}
+
+void
+ThreadedTransport::FrameReceived(const unsigned char* buffer, size_t length)
+{
+    Deliver(THREADED_FRAME_RECEIVED, buffer, length);
+}
+
+void
+ThreadedTransport::FrameSent()
+{
+    Deliver(THREADED_FRAME_SENT);
+}
+
+void
+ThreadedTransport::TransportFailed()
+{
+    Deliver(THREADED_FAILED);
+}
+
+void
+ThreadedTransport::TransportFinished()
+{
+    Deliver(THREADED_FINISHED);
+}
+
+void
+ThreadedTransport::TransportLost()
+{
+    Deliver(THREADED_LOST);
+}
+
+void
+ThreadedTransport::TransportRestored()
+{
+    Deliver(THREADED_RESTORED);
+}
+
+// Logging is safe from any thread, and goes straight through
+
+void
+ThreadedTransport::Error(const char* fmt, ...)
+{
+    char buffer[256];
+    va_list argptr;
+
+    va_start(argptr, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, argptr);
+    va_end(argptr);
+
+    listener->Error("%s", buffer);
+}
+
+void
+ThreadedTransport::Info(const char* fmt, ...)
+{
+    char buffer[256];
+    va_list argptr;
+
+    va_start(argptr, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, argptr);
+    va_end(argptr);
+
+    listener->Info("%s", buffer);
+}
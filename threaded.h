@@ -0,0 +1,114 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _THREADED_H_
+#define _THREADED_H_
+
+#include <atomic>
+#include <thread>
+
+#include "ring.h"
+#include "transport.h"
+
+enum threaded_event
+{
+    THREADED_FRAME_RECEIVED,
+    THREADED_FRAME_SENT,
+    THREADED_FAILED,
+    THREADED_FINISHED,
+    THREADED_LOST,
+    THREADED_RESTORED
+};
+
+// What passes between the threads
+
+struct threaded_frame
+{
+    threaded_event event;
+    size_t length;
+    unsigned char frame[INTR_RECV_LENGTH];
+};
+
+// Frames from the stick that can be waiting for the gateway
+
+#define THREADED_RING_SIZE	256
+
+/* This class runs another transport on a thread of its own, so that
+   the stick is served even while the gateway thread is busy, eg.
+   writing to a slow broker.  Frames and events from the stick are
+   handed over through a lock free ring and an eventfd in the
+   gateway's epoll set, and frames to the stick the same way in the
+   other direction.  The listener is only called on the gateway
+   thread, except for logging. */
+
+class ThreadedTransport
+    : public Transport,
+      private TransportListener
+{
+public:
+
+    ThreadedTransport(Transport* transport);
+
+    virtual bool Init(int epoll_fd, TransportListener* listener);
+    virtual void Stop();
+
+    virtual void Poll(const epoll_event& event);
+
+    virtual int Send(const unsigned char* buffer, size_t length);
+
+    virtual void Reset();
+
+private:
+
+    // The transport's thread
+
+    void Run();
+
+    // Called by the transport, on its thread
+
+    virtual void FrameReceived(const unsigned char* buffer, size_t length);
+    virtual void FrameSent();
+    virtual void TransportFailed();
+    virtual void TransportFinished();
+    virtual void TransportLost();
+    virtual void TransportRestored();
+
+    virtual void Error(const char* fmt, ...);
+    virtual void Info(const char* fmt, ...);
+
+    void Deliver(threaded_event event, const unsigned char* buffer = NULL, size_t length = 0);
+
+    Transport* transport;
+    TransportListener* listener;
+
+    // The gateway's epoll set, and the one the transport runs in
+
+    int epoll_fd;
+    int thread_epoll_fd;
+
+    // Signalled when the ring towards the gateway or the transport
+    // has been filled
+
+    int inbound_fd;
+    int outbound_fd;
+
+    SpscRing<threaded_frame, THREADED_RING_SIZE> inbound;
+
+    // Only one frame is sent at a time
+
+    SpscRing<threaded_frame, 2> outbound;
+
+    std::thread thread;
+    std::atomic<bool> stopping;
+
+    // The gateway asked for the stick to be reset
+
+    std::atomic<bool> reset_requested;
+};
+
+#endif
@@ -0,0 +1,87 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <stddef.h>
+
+struct epoll_event;
+
+// Frames to and from the stick are always this long
+
+#define INTR_RECV_LENGTH	32
+#define INTR_SEND_LENGTH	32
+
+// Receives frames and events from a transport
+
+class TransportListener
+{
+public:
+
+    virtual ~TransportListener() {}
+
+    // A frame arrived from the stick
+
+    virtual void FrameReceived(const unsigned char* buffer, size_t length) = 0;
+
+    // The last frame passed to Send() has been handed to the stick
+
+    virtual void FrameSent() = 0;
+
+    // The transport can't continue
+
+    virtual void TransportFailed() = 0;
+
+    // There's nothing more to come, eg. at the end of a replay
+
+    virtual void TransportFinished() = 0;
+
+    /* The stick went away, along with any frame in flight; the
+       transport is waiting for it to come back */
+
+    virtual void TransportLost() = 0;
+
+    // The stick is back, and frames can be sent again
+
+    virtual void TransportRestored() = 0;
+
+    virtual void Error(const char* fmt, ...) = 0;
+    virtual void Info(const char* fmt, ...) = 0;
+};
+
+/* This class moves raw frames between the gateway and a stick.  Only
+   one frame is sent at a time; Send() isn't called again until
+   FrameSent() has been reported. */
+
+class Transport
+{
+public:
+
+    virtual ~Transport() {}
+
+    virtual bool Init(int epoll_fd, TransportListener* listener) = 0;
+    virtual void Stop() = 0;
+
+    // Called for epoll events that aren't handled by the gateway
+
+    virtual void Poll(const epoll_event& event) = 0;
+
+    /* Returns -1 if the frame couldn't be handed over.  The transport
+       then reports the stick as lost or failed, unless it already
+       has. */
+
+    virtual int Send(const unsigned char* buffer, size_t length) = 0;
+
+    /* Reset the stick; it's reported as lost, and then as restored
+       once it's back.  Transports that can't be reset ignore this. */
+
+    virtual void Reset() {}
+};
+
+#endif
@@ -11,123 +11,131 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <poll.h>
+#include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include "usb.h"
 
 #define EP_IN			(1 | LIBUSB_ENDPOINT_IN)
 #define EP_OUT			(2 | LIBUSB_ENDPOINT_OUT)
 
-extern int do_exit;
+#define XC_VENDOR_ID		0x188a
+#define XC_PRODUCT_ID		0x1101
 
 void
-USB::received(struct libusb_transfer* transfer)
+LibusbTransport::received(struct libusb_transfer* transfer)
 {
-    USB* this_object = (USB*) transfer->user_data;
+    LibusbTransport* this_object = (LibusbTransport*) transfer->user_data;
 
     this_object->Received(transfer);
 }
 
 void
-USB::Received(struct libusb_transfer* transfer)
+LibusbTransport::Received(struct libusb_transfer* transfer)
 {
-    if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+    if (closing)
     {
-	Error("irq transfer status %d, terminating\n", transfer->status);
+	// Cancelled by Close()
 
-	do_exit = 2;
 	libusb_free_transfer(transfer);
 	recv_transfer = NULL;
     }
+    else if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+    {
+	listener->Error("irq transfer status %d\n", transfer->status);
+
+	libusb_free_transfer(transfer);
+	recv_transfer = NULL;
+
+	Lost();
+    }
     else
     {
-	xc_parse_packet((unsigned char*) transfer->buffer, transfer->length, &data);
+	listener->FrameReceived((unsigned char*) transfer->buffer, transfer->length);
 
 	// Resubmit transfer
     
 	if (libusb_submit_transfer(recv_transfer) < 0)
-	    do_exit = 2;
+	    Lost();
     }
 }
 
 void
-USB::relno(void* user_data,
-	   int status,
-	   unsigned int rf_major,
-	   unsigned int rf_minor,
-	   unsigned int usb_major,
-	   unsigned int usb_minor)
+LibusbTransport::sent(struct libusb_transfer* transfer)
 {
-    USB* this_object = (USB*) user_data;
+    LibusbTransport* this_object = (LibusbTransport*) transfer->user_data;
 
-    this_object->Relno(status, rf_major, rf_minor, usb_major, usb_minor);
+    this_object->Sent(transfer);
 }
 
 void
-USB::message_received(void* user_data,
-		      mci_rx_event event,
-		      int datapoint,
-		      mci_rx_datatype data_type,
-		      int value,
-		      int signal,
-		      mgw_rx_battery battery,
-		      int seq_no)
+LibusbTransport::Sent(struct libusb_transfer* transfer)
 {
-    USB* this_object = (USB*) user_data;
+    if (closing)
+    {
+	libusb_free_transfer(transfer);
+	send_transfer = NULL;
+    }
+    else if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+    {
+	listener->Error("irq transfer status %d?\n", transfer->status);
 
-    this_object->MessageReceived(event,
-				 datapoint,
-				 data_type,
-				 value,
-				 signal,
-				 battery,
-                                 seq_no);
+	libusb_free_transfer(transfer);
+	send_transfer = NULL;
+
+	Lost();
+    }
+    else
+	listener->FrameSent();
 }
 
-void
-USB::ack_received(void* user_data,
-		   int success,
-		   int seq_no,
-		   int extra)
+int
+LibusbTransport::hotplug(libusb_context* context,
+			 libusb_device* device,
+			 libusb_hotplug_event event,
+			 void* user_data)
 {
-    USB* this_object = (USB*) user_data;
+    LibusbTransport* this_object = (LibusbTransport*) user_data;
+
+    this_object->Hotplug(device, event);
 
-    this_object->AckReceived(success, seq_no, extra);
+    return 0;
 }
 
 void
-USB::sent(struct libusb_transfer* transfer)
+LibusbTransport::Hotplug(libusb_device* device, libusb_hotplug_event event)
 {
-    USB* this_object = (USB*) transfer->user_data;
+    /* Only flag the event here; libusb doesn't allow opening or
+       closing devices from inside the callback.  Poll() acts on it. */
 
-    this_object->Sent(transfer);
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+	device_arrived = true;
+    else if (handle && libusb_get_device(handle) == device)
+	device_lost = true;
 }
 
 void
-USB::Sent(struct libusb_transfer* transfer)
+LibusbTransport::Lost()
 {
-    if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
-    {
-	Error("irq transfer status %d?\n", transfer->status);
-	
-	do_exit = 2;
-	libusb_free_transfer(transfer);
-	send_transfer = NULL;
-    }
+    if (hotplug_registered)
+	device_lost = true;
     else
-	message_in_transit = false;
+	// Nothing will tell us when the stick is back
+
+	listener->TransportFailed();
 }
 
 void
-USB::fd_added(int fd, short fd_events, void * source)
+LibusbTransport::fd_added(int fd, short fd_events, void * source)
 {
-    USB* this_object = (USB*) source;
+    LibusbTransport* this_object = (LibusbTransport*) source;
 
     this_object->FDAdded(fd, fd_events);
 }
 
 void
-USB::FDAdded(int fd, short fd_events)
+LibusbTransport::FDAdded(int fd, short fd_events)
 {
     epoll_event events;
 
@@ -138,26 +146,26 @@ USB::FDAdded(int fd, short fd_events)
 	events.events |= EPOLLOUT;
 
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &events) < 0)
-        Error("epoll_ctl failed %s\n", strerror(errno));
+        listener->Error("epoll_ctl failed %s\n", strerror(errno));
 }
 
 void
-USB::fd_removed(int fd, void* source)
+LibusbTransport::fd_removed(int fd, void* source)
 {
-    USB* this_object = (USB*) source;
+    LibusbTransport* this_object = (LibusbTransport*) source;
 
     this_object->FDRemoved(fd);
 }
 
 void
-USB::FDRemoved(int fd)
+LibusbTransport::FDRemoved(int fd)
 {
     if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
-        Error("epoll_ctl failed %s\n", strerror(errno));
+        listener->Error("epoll_ctl failed %s\n", strerror(errno));
 }
 
 bool
-USB::init_fds()
+LibusbTransport::init_fds()
 {
     const struct libusb_pollfd** usb_fds = libusb_get_pollfds(context);
     
@@ -174,38 +182,88 @@ USB::init_fds()
     return true;
 }
 
-USB::USB()
+LibusbTransport::LibusbTransport()
     : epoll_fd(-1),
-      message_in_transit(true),
+      listener(NULL),
       context(NULL),
       handle(NULL),
       recv_transfer(NULL),
-      send_transfer(NULL)
+      send_transfer(NULL),
+      hotplug_registered(false),
+      device_arrived(false),
+      device_lost(false),
+      closing(false),
+      reopen_fd(-1),
+      reopening(false),
+      reopen_delay(USB_REOPEN_MIN),
+      reopen_failures(0)
 {
-    data.recv = message_received;
-    data.ack = ack_received;
-    data.relno = relno;
-    data.user_data = this;
 }
 
 bool
-USB::Init(int fd)
+LibusbTransport::Init(int fd, TransportListener* listener)
 {
     int err;
     
     epoll_fd = fd;
+    this->listener = listener;
 
     err = libusb_init(&context);
     if (err < 0)
     {
-	Error("failed to initialise libusb\n");
+	listener->Error("failed to initialise libusb\n");
 	return false;
     }
-    
-    handle = libusb_open_device_with_vid_pid(context, 0x188a, 0x1101);
+
+    if (!init_fds())
+	return false;
+
+    epoll_event event;
+
+    reopen_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = this;
+
+    if (reopen_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reopen_fd, &event) < 0)
+    {
+	listener->Error("failed to set up reopen timer %s\n", strerror(errno));
+	return false;
+    }
+
+    // Without hotplug support, losing the stick is fatal
+
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+    {
+	err = libusb_hotplug_register_callback(context,
+					       (libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+								       LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+					       (libusb_hotplug_flag) 0,
+					       XC_VENDOR_ID,
+					       XC_PRODUCT_ID,
+					       LIBUSB_HOTPLUG_MATCH_ANY,
+					       hotplug,
+					       this,
+					       &hotplug_handle);
+	if (err < 0)
+	    listener->Error("failed to register hotplug callback %d\n", err);
+	else
+	    hotplug_registered = true;
+    }
+
+    return Open();
+}
+
+bool
+LibusbTransport::Open()
+{
+    int err;
+
+    handle = libusb_open_device_with_vid_pid(context, XC_VENDOR_ID, XC_PRODUCT_ID);
     if (!handle)
     {
-	Error("Could not find/open xComfort USB device\n");
+	listener->Error("Could not find/open xComfort USB device\n");
 	return false;
     }
     
@@ -214,7 +272,8 @@ USB::Init(int fd)
 	err = libusb_detach_kernel_driver(handle, 0);
 	if (err < 0)
 	{
-	    Error("usb_detach_kernel_driver %d\n", err);
+	    listener->Error("usb_detach_kernel_driver %d\n", err);
+	    Close();
 	    return false;
 	}
     }
@@ -222,21 +281,25 @@ USB::Init(int fd)
     err = libusb_set_configuration(handle, 1); 
     if (err < 0)
     { 
-	Error("libusb_set_configuration error %d\n", err);
+	listener->Error("libusb_set_configuration error %d\n", err);
+	Close();
 	return false;
     } 
     
     err = libusb_claim_interface(handle, 0);
     if (err < 0)
     {
-	Error("usb_claim_interface error %d\n", err);
+	listener->Error("usb_claim_interface error %d\n", err);
+	libusb_close(handle);
+	handle = NULL;
 	return false;
     }
     
     recv_transfer = libusb_alloc_transfer(0);
     if (!recv_transfer)
     {
-	Error("failed to allocate transfer %d\n", err);
+	listener->Error("failed to allocate transfer %d\n", err);
+	Close();
 	return false;
     }
     
@@ -246,7 +309,8 @@ USB::Init(int fd)
     send_transfer = libusb_alloc_transfer(0);
     if (!send_transfer)
     {
-	Error("failed to allocate transfer %d\n", err);
+	listener->Error("failed to allocate transfer %d\n", err);
+	Close();
 	return false;
     }
     
@@ -255,35 +319,170 @@ USB::Init(int fd)
 
     err = libusb_submit_transfer(recv_transfer);
     if (err < 0)
+    {
+	listener->Error("failed to submit transfer %d\n", err);
+	Close();
 	return false;
-
-    xc_make_config_msg((char*) sendbuf, MGW_CT_RELEASE, 0x0);
-    
-    err = libusb_submit_transfer(send_transfer);
-    if (err < 0)
-	return false;
-    
-    if (!init_fds())
-	return false;
+    }
 
     return true;
 }
 
 void
-USB::Poll(const epoll_event& event)
+LibusbTransport::CancelTransfers()
+{
+    // Transfers complete as cancelled; don't report that as a failure
+
+    closing = true;
+
+    if (recv_transfer)
+	if (!libusb_cancel_transfer(recv_transfer))
+	    while (recv_transfer)
+		if (libusb_handle_events(context) < 0)
+		    break;
+
+    if (send_transfer)
+	if (!libusb_cancel_transfer(send_transfer))
+	    while (send_transfer)
+		if (libusb_handle_events(context) < 0)
+		    break;
+
+    closing = false;
+}
+
+void
+LibusbTransport::Close()
+{
+    CancelTransfers();
+
+    if (recv_transfer)
+    {
+	libusb_free_transfer(recv_transfer);
+	recv_transfer = NULL;
+    }
+
+    if (send_transfer)
+    {
+	libusb_free_transfer(send_transfer);
+	send_transfer = NULL;
+    }
+
+    if (handle)
+    {
+	libusb_release_interface(handle, 0);
+	libusb_close(handle);
+	handle = NULL;
+    }
+}
+
+void
+LibusbTransport::Poll(const epoll_event& event)
 {
     struct timeval tv = { 0, 0 };
 
     libusb_handle_events_timeout(context, &tv);
+
+    if (device_lost)
+    {
+	device_lost = false;
+
+	Close();
+	listener->Info("lost contact with the stick\n");
+	listener->TransportLost();
+
+	// It may still be there, if only a transfer failed
+
+	device_arrived = true;
+    }
+
+    uint64_t expirations;
+
+    if (read(reopen_fd, &expirations, sizeof(expirations)) > 0 && reopening)
+	device_arrived = true;
+
+    if (device_arrived && !handle)
+    {
+	device_arrived = false;
+	Reopen();
+    }
+}
+
+void
+LibusbTransport::Reopen()
+{
+    itimerspec timer;
+
+    memset(&timer, 0, sizeof(timer));
+
+    if (Open())
+    {
+	reopening = false;
+	reopen_delay = USB_REOPEN_MIN;
+	reopen_failures = 0;
+
+	timerfd_settime(reopen_fd, 0, &timer, NULL);
+
+	listener->Info("reconnected to the stick\n");
+	listener->TransportRestored();
+	return;
+    }
+
+    /* A stick that was unplugged is waited for; hotplug or the timer
+       brings it back.  One that's there, but can't be opened, won't
+       get any better. */
+
+    if ((!hotplug_registered || Present()) && ++reopen_failures >= USB_REOPEN_ATTEMPTS)
+    {
+	listener->Error("giving up on the stick\n");
+
+	reopening = false;
+	listener->TransportFailed();
+	return;
+    }
+
+    if (!reopening)
+	listener->Info("waiting for the stick to be plugged in\n");
+
+    reopening = true;
+
+    timer.it_value.tv_sec = reopen_delay / 1000;
+    timer.it_value.tv_nsec = (reopen_delay % 1000) * 1000000;
+    timerfd_settime(reopen_fd, 0, &timer, NULL);
+
+    reopen_delay *= 2;
+    if (reopen_delay > USB_REOPEN_MAX)
+	reopen_delay = USB_REOPEN_MAX;
 }
 
+bool
+LibusbTransport::Present()
+{
+    libusb_device** devices;
+    libusb_device_descriptor descriptor;
+    bool present = false;
+
+    ssize_t count = libusb_get_device_list(context, &devices);
+
+    if (count < 0)
+	return false;
+
+    for (ssize_t i = 0; i < count && !present; ++i)
+	if (libusb_get_device_descriptor(devices[i], &descriptor) == 0 &&
+	    descriptor.idVendor == XC_VENDOR_ID && descriptor.idProduct == XC_PRODUCT_ID)
+	    present = true;
+
+    libusb_free_device_list(devices, 1);
+
+    return present;
+}
 
 int
-USB::Send(const char* buffer, size_t length)
+LibusbTransport::Send(const unsigned char* buffer, size_t length)
 {
     int err;
 
-    assert(!message_in_transit);
+    if (!send_transfer)
+	return -1;
 
     bzero(sendbuf, INTR_SEND_LENGTH);
     memcpy(sendbuf, buffer, length);
@@ -291,44 +490,251 @@ USB::Send(const char* buffer, size_t length)
     err = libusb_submit_transfer(send_transfer);
     if (err < 0)
     {
-	Error("failed to submit transfer\n");
+	listener->Error("failed to submit transfer\n");
+	Lost();
+
+	if (device_lost)
+	{
+	    // Have Poll() act on it now, rather than at the next event
+
+	    itimerspec timer;
+
+	    memset(&timer, 0, sizeof(timer));
+	    timer.it_value.tv_nsec = 1;
+
+	    timerfd_settime(reopen_fd, 0, &timer, NULL);
+	}
+
 	return -1;
     }
 
-    message_in_transit = true;
-
     return 0;
 }
 
 void
-USB::Stop()
+LibusbTransport::Reset()
 {
-    if (context)
-    {
-	if (recv_transfer)
-	    if (!libusb_cancel_transfer(recv_transfer))
-		while (recv_transfer)
-		    if (libusb_handle_events(NULL) < 0)
-			break;
+    if (!handle)
+	return;
 
-	if (send_transfer)
-	    if (!libusb_cancel_transfer(send_transfer))
-		while (send_transfer)
-		    if (libusb_handle_events(NULL) < 0)
-			break;
+    CancelTransfers();
 
-	if (recv_transfer)
-	    libusb_free_transfer(recv_transfer);
+    /* The stick may come back as a new device, in which case the
+       handle is useless; always start over with a new one. */
+
+    int err = libusb_reset_device(handle);
+
+    if (err < 0 && err != LIBUSB_ERROR_NOT_FOUND)
+	listener->Error("libusb_reset_device error %d\n", err);
+
+    Close();
+    listener->TransportLost();
+
+    Reopen();
+}
 
-	if (send_transfer)
-	    libusb_free_transfer(send_transfer);
+void
+LibusbTransport::Stop()
+{
+    if (context)
+    {
+	Close();
 
-	if (handle)
+	if (hotplug_registered)
 	{
-	    libusb_release_interface(handle, 0);
-	    libusb_close(handle);
+	    libusb_hotplug_deregister_callback(context, hotplug_handle);
+	    hotplug_registered = false;
 	}
 
 	libusb_exit(context);
+	context = NULL;
+    }
+
+    if (reopen_fd != -1)
+    {
+	close(reopen_fd);
+	reopen_fd = -1;
     }
-}    
+}
+
+void
+USB::relno(void* user_data,
+	   int status,
+	   unsigned int rf_major,
+	   unsigned int rf_minor,
+	   unsigned int usb_major,
+	   unsigned int usb_minor)
+{
+    USB* this_object = (USB*) user_data;
+
+    this_object->Relno(status, rf_major, rf_minor, usb_major, usb_minor);
+}
+
+void
+USB::message_received(void* user_data,
+		      mci_rx_event event,
+		      int datapoint,
+		      mci_rx_datatype data_type,
+		      int value,
+		      int signal,
+		      mgw_rx_battery battery,
+		      int seq_no)
+{
+    USB* this_object = (USB*) user_data;
+
+    this_object->MessageReceived(event,
+				 datapoint,
+				 data_type,
+				 value,
+				 signal,
+				 battery,
+                                 seq_no);
+}
+
+void
+USB::ack_received(void* user_data,
+		   int success,
+		   int seq_no,
+		   int extra,
+		   int error)
+{
+    USB* this_object = (USB*) user_data;
+
+    this_object->AckReceived(success, seq_no, extra, error);
+}
+
+void
+USB::info_received(void* user_data,
+		   int type,
+		   unsigned int value)
+{
+    USB* this_object = (USB*) user_data;
+
+    this_object->ConfigReply(type, value);
+}
+
+USB::USB()
+    : epoll_fd(-1),
+      clock(&monotonic_clock),
+      loop(NULL),
+      message_in_transit(true),
+      waiting_since(-1),
+      transport(&usb_transport)
+{
+    data.recv = message_received;
+    data.ack = ack_received;
+    data.relno = relno;
+    data.info = info_received;
+    data.user_data = this;
+}
+
+bool
+USB::Init(int fd)
+{
+    char buffer[4];
+
+    epoll_fd = fd;
+
+    if (!transport->Init(epoll_fd, this))
+	return false;
+
+    // The stick replies with its release numbers
+
+    message_in_transit = false;
+
+    xc_make_config_msg(buffer, MGW_CT_RELEASE, 0x0);
+
+    return Send(buffer, 4) == 0;
+}
+
+void
+USB::Poll(const epoll_event& event)
+{
+    transport->Poll(event);
+}
+
+void
+USB::ResetStick()
+{
+    Info("resetting the stick\n");
+    transport->Reset();
+}
+
+int
+USB::Send(const char* buffer, size_t length)
+{
+    assert(!message_in_transit);
+
+    if (transport->Send((const unsigned char*) buffer, length) < 0)
+	return -1;
+
+    capture.Write(CAPTURE_OUT, (const unsigned char*) buffer, length);
+
+    message_in_transit = true;
+
+    if (waiting_since == -1)
+	waiting_since = clock->Now();
+
+    return 0;
+}
+
+void
+USB::FrameReceived(const unsigned char* buffer, size_t length)
+{
+    capture.Write(CAPTURE_IN, buffer, length);
+
+    waiting_since = -1;
+
+    xc_parse_packet(buffer, length, &data);
+}
+
+void
+USB::FrameSent()
+{
+    message_in_transit = false;
+}
+
+void
+USB::TransportFailed()
+{
+    if (loop)
+	loop->Exit(EXIT_FAILURE);
+}
+
+void
+USB::TransportFinished()
+{
+    if (loop)
+	loop->Exit(EXIT_SUCCESS);
+}
+
+void
+USB::TransportLost()
+{
+    // Nothing can be sent until the stick is back
+
+    message_in_transit = true;
+    waiting_since = -1;
+
+    StickLost();
+}
+
+void
+USB::TransportRestored()
+{
+    char buffer[4];
+
+    message_in_transit = false;
+
+    // Same handshake as at startup
+
+    xc_make_config_msg(buffer, MGW_CT_RELEASE, 0x0);
+    Send(buffer, 4);
+}
+
+void
+USB::Stop()
+{
+    transport->Stop();
+    capture.Close();
+}
@@ -11,19 +11,149 @@
 
 #include <libusb-1.0/libusb.h>
 
+#include "capture.h"
+#include "clock.h"
 #include "ckoz0014.h"
+#include "eventloop.h"
+#include "transport.h"
 
-#define INTR_RECV_LENGTH	32
-#define INTR_SEND_LENGTH	32
+/* Delay in ms before trying to reopen the stick, doubled on every
+   failure.  A stick that is there but can't be opened is given up on
+   after USB_REOPEN_ATTEMPTS tries; one that has been unplugged is
+   waited for. */
 
-// This class implements the USB communication layer with the stick.
+#define USB_REOPEN_MIN		1000
+#define USB_REOPEN_MAX		30000
+#define USB_REOPEN_ATTEMPTS	8
+
+/* This class talks to a CKOZ-00/14 plugged into the USB port.  If
+   libusb supports hotplug, the stick is reopened when it's plugged
+   back in, or when a transfer fails. */
+
+class LibusbTransport
+    : public Transport
+{
+public:
+
+    LibusbTransport();
+
+    virtual bool Init(int epoll_fd, TransportListener* listener);
+    virtual void Stop();
+
+    virtual void Poll(const epoll_event& event);
+
+    virtual int Send(const unsigned char* buffer, size_t length);
+
+    virtual void Reset();
+
+private:
+
+    static void sent(struct libusb_transfer* transfer);
+    static void received(struct libusb_transfer* transfer);
+
+    void Sent(struct libusb_transfer* transfer);
+    void Received(struct libusb_transfer* transfer);
+
+    static void fd_added(int fd, short fd_events, void* source);
+    static void fd_removed(int fd, void* source);
+
+    void FDAdded(int fd, short fd_events);
+    void FDRemoved(int fd);
+
+    static int hotplug(libusb_context* context,
+		       libusb_device* device,
+		       libusb_hotplug_event event,
+		       void* user_data);
+
+    void Hotplug(libusb_device* device, libusb_hotplug_event event);
+
+    bool init_fds();
+
+    // Claim the stick and start receiving, and undo that
+
+    bool Open();
+    void Close();
+
+    // Cancel the transfers, and wait for them to complete
+
+    void CancelTransfers();
+
+    // A transfer failed; the stick is probably gone
+
+    void Lost();
+
+    // Try to open the stick again, and schedule another try if that
+    // fails
+
+    void Reopen();
+
+    // The stick is on the bus, whether or not it can be opened
+
+    bool Present();
+
+    int epoll_fd;
+
+    TransportListener* listener;
+
+    libusb_context* context;
+    libusb_device_handle* handle;
+
+    unsigned char recvbuf[INTR_RECV_LENGTH];
+    libusb_transfer* recv_transfer;
+
+    unsigned char sendbuf[INTR_SEND_LENGTH];
+    libusb_transfer* send_transfer;
+
+    libusb_hotplug_callback_handle hotplug_handle;
+    bool hotplug_registered;
+
+    // Set from libusb callbacks, handled in Poll()
+
+    bool device_arrived;
+    bool device_lost;
+
+    // Transfers are being cancelled
+
+    bool closing;
+
+    // Timer for the next try at reopening the stick
+
+    int reopen_fd;
+    bool reopening;
+    int reopen_delay;
+    int reopen_failures;
+};
+
+// This class implements the communication layer with the stick.
 
 class USB
+    : public TransportListener
 {
 public:
 
     USB();
 
+    // Use another transport than the USB stick; call before Init()
+
+    void SetTransport(Transport* transport) { this->transport = transport; }
+    Transport* GetTransport() const { return transport; }
+
+    // Use another clock than the monotonic one; call before Init()
+
+    void SetClock(Clock* clock) { this->clock = clock; }
+
+    // Loop to stop when the transport fails or finishes
+
+    void SetEventLoop(EventLoop* loop) { this->loop = loop; }
+
+    // Record all frames to and from the stick in a capture file
+
+    bool Capture(const char* path) { return capture.Open(path); }
+
+    // Write out the frames captured so far
+
+    void FlushCapture() { capture.Flush(); }
+
     virtual bool Init(int epoll_fd);
     virtual void Stop();
 
@@ -32,13 +162,23 @@ public:
     bool CanSend() const { return !message_in_transit; }
     int Send(const char* buffer, size_t length);
 
-protected:
+    // Reset the stick, eg. when it has stopped responding
 
-    virtual void Error(const char* fmt, ...) = 0;
-    virtual void Info(const char* fmt, ...) = 0;
+    void ResetStick();
+
+    /* When the stick was first sent a frame it hasn't answered
+       anything since, or -1 if it owes us nothing */
+
+    int64_t WaitingSince() const { return waiting_since; }
+
+protected:
 
     int epoll_fd;
 
+    Clock* clock;
+
+    EventLoop* loop;
+
 private:
 
     static void relno(void* user_data,
@@ -60,7 +200,12 @@ private:
     static void ack_received(void* user_data,
 			     int success,
 			     int seq_no,
-			     int extra);
+			     int extra,
+			     int error);
+
+    static void info_received(void* user_data,
+			      int type,
+			      unsigned int value);
 
     virtual void Relno(int status,
 		       unsigned int rf_major,
@@ -78,34 +223,37 @@ private:
 
     virtual void AckReceived(int success,
 			     int seq_no,
-			     int extra) {}
+			     int extra,
+			     int error) {}
 
-    static void sent(struct libusb_transfer* transfer);
-    static void received(struct libusb_transfer* transfer);
+    // A reply to one of the MGW_CT_COUNTER_RX/TX, MGW_CT_SERIAL or
+    // MGW_CT_TIMEACCOUNT queries
 
-    void Sent(struct libusb_transfer* transfer);
-    void Received(struct libusb_transfer* transfer);
+    virtual void ConfigReply(int type, unsigned int value) {}
 
-    static void fd_added(int fd, short fd_events, void* source);
-    static void fd_removed(int fd, void* source);
+    // Messages sent to the stick were lost along with it
 
-    void FDAdded(int fd, short fd_events);
-    void FDRemoved(int fd);
+    virtual void StickLost() {}
 
-    bool init_fds();
+    virtual void FrameReceived(const unsigned char* buffer, size_t length);
+    virtual void FrameSent();
+    virtual void TransportFailed();
+    virtual void TransportFinished();
+    virtual void TransportLost();
+    virtual void TransportRestored();
 
     bool message_in_transit;
 
+    int64_t waiting_since;
+
     xc_parse_data data;
 
-    libusb_context* context;
-    libusb_device_handle* handle;
+    LibusbTransport usb_transport;
+    Transport* transport;
 
-    unsigned char recvbuf[INTR_RECV_LENGTH];
-    libusb_transfer* recv_transfer;
+    CaptureWriter capture;
 
-    unsigned char sendbuf[INTR_SEND_LENGTH];
-    libusb_transfer* send_transfer;
+    MonotonicClock monotonic_clock;
 };
 
 #endif
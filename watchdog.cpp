@@ -0,0 +1,71 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#include "watchdog.h"
+
+Watchdog::Watchdog()
+    : max_failures(0),
+      max_silence(0),
+      failures(0),
+      next_reset(0),
+      holdoff(WATCHDOG_MIN_HOLDOFF)
+{
+}
+
+void
+Watchdog::Configure(int failures, int silence)
+{
+    max_failures = failures;
+    max_silence = silence;
+}
+
+void
+Watchdog::Success()
+{
+    // The stick works; if it stops again, it's a new problem
+
+    failures = 0;
+    holdoff = WATCHDOG_MIN_HOLDOFF;
+}
+
+bool
+Watchdog::Expired(int64_t waiting_since, int64_t current_time) const
+{
+    if (Holding(current_time))
+	return false;
+
+    if (max_failures && failures >= max_failures)
+	return true;
+
+    return max_silence && waiting_since != -1 && current_time - waiting_since >= max_silence;
+}
+
+int64_t
+Watchdog::NextDeadline(int64_t waiting_since) const
+{
+    if (max_failures && failures >= max_failures)
+	return next_reset;
+
+    if (!max_silence || waiting_since == -1)
+	return INT64_MAX;
+
+    int64_t deadline = waiting_since + max_silence;
+
+    return deadline > next_reset ? deadline : next_reset;
+}
+
+void
+Watchdog::Reset(int64_t current_time)
+{
+    failures = 0;
+    next_reset = current_time + holdoff;
+
+    holdoff *= 2;
+    if (holdoff > WATCHDOG_MAX_HOLDOFF)
+	holdoff = WATCHDOG_MAX_HOLDOFF;
+}
@@ -0,0 +1,76 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _WATCHDOG_H_
+#define _WATCHDOG_H_
+
+#include <stdint.h>
+
+/* Time in ms between resets of a stick that doesn't recover; doubled
+   for each reset that doesn't help. */
+
+#define WATCHDOG_MIN_HOLDOFF	30000
+#define WATCHDOG_MAX_HOLDOFF	600000
+
+/* This class decides when the stick has stopped working and needs to
+   be reset: when too many messages in a row fail, or when it hasn't
+   answered anything for too long after being sent a frame.  Resets
+   are spaced out, so a stick that doesn't recover isn't reset over
+   and over. */
+
+class Watchdog
+{
+public:
+
+    Watchdog();
+
+    // Failures in a row, and ms without an answer, before resetting;
+    // 0 disables either
+
+    void Configure(int failures, int silence);
+
+    // A message was acked, or failed
+
+    void Success();
+    void Failure() { failures++; }
+
+    /* True if the stick should be reset.  waiting_since is when the
+       stick was first sent a frame it hasn't answered anything
+       since, or -1 if it owes us nothing. */
+
+    bool Expired(int64_t waiting_since, int64_t current_time) const;
+
+    // When Expired() may become true, or INT64_MAX if it can't
+
+    int64_t NextDeadline(int64_t waiting_since) const;
+
+    // Resets aren't allowed until NextReset()
+
+    bool Holding(int64_t current_time) const { return current_time < next_reset; }
+    int64_t NextReset() const { return next_reset; }
+
+    // The stick is being reset
+
+    void Reset(int64_t current_time);
+
+private:
+
+    int max_failures;
+    int max_silence;
+
+    // Messages that failed in a row
+
+    int failures;
+
+    // No reset before this time
+
+    int64_t next_reset;
+    int holdoff;
+};
+
+#endif
@@ -0,0 +1,60 @@
+/* -*- Mode: C++; c-file-style: "stroustrup" -*- */
+
+/*
+ *  Copyright 2016 Karl Anders Oygard. All rights reserved.
+ *  Use of this source code is governed by a BSD-style license that can be
+ *  found in the LICENSE file.
+ */
+
+#ifndef _WIRE_H_
+#define _WIRE_H_
+
+#include <stdint.h>
+
+/* Loads and stores of multi-byte fields in messages to and from the
+   stick.  The fields are unaligned and their byte order is fixed, so
+   they're assembled byte by byte; compilers turn this into a single
+   load or store where the target allows unaligned access and has
+   the matching byte order, and into byte accesses elsewhere. */
+
+constexpr uint16_t
+xc_load_le16(const unsigned char* p)
+{
+    return uint16_t(p[0] | (p[1] << 8));
+}
+
+constexpr uint32_t
+xc_load_le32(const unsigned char* p)
+{
+    return (uint32_t(p[0]) |
+	    (uint32_t(p[1]) << 8) |
+	    (uint32_t(p[2]) << 16) |
+	    (uint32_t(p[3]) << 24));
+}
+
+constexpr uint32_t
+xc_load_be32(const unsigned char* p)
+{
+    return ((uint32_t(p[0]) << 24) |
+	    (uint32_t(p[1]) << 16) |
+	    (uint32_t(p[2]) << 8) |
+	    uint32_t(p[3]));
+}
+
+inline void
+xc_store_le16(unsigned char* p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+inline void
+xc_store_le32(unsigned char* p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+#endif